@@ -0,0 +1,11 @@
+SRC_DIR = src/app/vdi_compact
+include $(GENODE_DIR)/repos/base/recipes/src/content.inc
+
+MIRROR_FROM_REP_DIR := src/server/vdi_block/vdi_meta_data.h \
+                       src/server/vdi_block/vdi_table.h \
+                       src/server/vdi_block/vdi_types.h
+
+content: $(MIRROR_FROM_REP_DIR)
+
+$(MIRROR_FROM_REP_DIR):
+	$(mirror_from_rep_dir)
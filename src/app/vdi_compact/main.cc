@@ -0,0 +1,295 @@
+/*
+ * \brief  Offline compaction of VDI images
+ * \author Alexander Boettcher
+ * \date   2026-10-16
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#include <base/attached_ram_dataspace.h>
+#include <base/attached_rom_dataspace.h>
+#include <base/component.h>
+#include <base/heap.h>
+#include <base/log.h>
+#include <os/vfs.h>
+
+/* vdi_block includes */
+#include <vdi_meta_data.h>
+
+namespace Vdi_compact {
+	struct Array_table;
+	struct Main;
+	using namespace Genode;
+}
+
+
+/*
+ * Block table kept in memory completely
+ */
+struct Vdi_compact::Array_table : Vdi::Table
+{
+	Attached_ram_dataspace _ds;
+
+	Vdi::Block * const _entries { _ds.local_addr<Vdi::Block>() };
+
+	Array_table(Ram_allocator &ram, Region_map &rm, uint32_t const blocks)
+	: _ds(ram, rm, max(size_t(blocks) * sizeof(Vdi::Block), size_t(1))) { }
+
+	char *content() { return _ds.local_addr<char>(); }
+
+	Vdi::Block block(uint64_t const bid) override { return _entries[bid]; }
+
+	void block(uint64_t const bid, Vdi::Block const value) override {
+		_entries[bid] = value; }
+};
+
+
+/*
+ * Rewrite the input image with the blocks in LBA order, blocks containing
+ * zeros only and blocks not referenced by the table are dropped
+ */
+struct Vdi_compact::Main
+{
+	using Path = Directory::Path;
+
+	enum { HEADER_SIZE = 4096 };
+
+	struct Failed : Exception { };
+
+	Env                    &_env;
+	Heap                    _heap   { _env.ram(), _env.rm() };
+	Attached_rom_dataspace  _config { _env, "config" };
+
+	Root_directory _root = _config.node().with_sub_node("vfs",
+		[&] (auto const &config) -> Root_directory {
+			return { _env, _heap, config }; },
+		[&] () -> Root_directory {
+			error("VFS not configured");
+			return { _env, _heap, { } }; });
+
+	Path const _input  = _config.node().attribute_value("input",  Path());
+	Path const _output = _config.node().attribute_value("output", Path());
+
+	void _read(Readonly_file const &file, uint64_t offset, char *dst, size_t size)
+	{
+		while (size) {
+			size_t const n = file.read(Readonly_file::At { offset },
+			                           Byte_range_ptr(dst, size));
+			if (!n) {
+				error("reading '", _input, "' at ", offset, " failed");
+				throw Failed();
+			}
+
+			offset += n;
+			dst    += n;
+			size   -= n;
+		}
+	}
+
+	void _append(New_file &file, char const * const src, size_t const size)
+	{
+		if (file.append(src, size) != New_file::Append_result::OK) {
+			error("writing '", _output, "' failed");
+			throw Failed();
+		}
+	}
+
+	/* copy range of the input file to the output file via 'buffer' */
+	void _copy(Readonly_file const &input, New_file &output,
+	           uint64_t from, uint64_t const to,
+	           char * const buffer, size_t const size)
+	{
+		while (from < to) {
+			size_t const n = size_t(min(uint64_t(size), to - from));
+
+			_read(input, from, buffer, n);
+			_append(output, buffer, n);
+
+			from += n;
+		}
+	}
+
+	bool _compact();
+
+	Main(Env &env) : _env(env)
+	{
+		bool success = false;
+
+		try {
+			success = _compact();
+		} catch (...) {
+			error("compaction of '", _input, "' failed");
+		}
+
+		_env.parent().exit(success ? 0 : 1);
+	}
+};
+
+
+bool Vdi_compact::Main::_compact()
+{
+	if (!_input.valid() || !_output.valid() || _input == _output) {
+		error("distinct 'input' and 'output' files required");
+		return false;
+	}
+
+	Readonly_file const input { _root, _input };
+
+	Attached_ram_dataspace header_ds { _env.ram(), _env.rm(), HEADER_SIZE };
+
+	char * const header = header_ds.local_addr<char>();
+
+	size_t const header_size = input.read(Readonly_file::At { 0 },
+	                                      Byte_range_ptr(header, HEADER_SIZE));
+
+	if (header_size < sizeof(Preheader) + sizeof(HeaderV1Plus)) {
+		error("read header to short");
+		return false;
+	}
+
+	Preheader const &ph = *(Preheader *)(header);
+	HeaderV1Plus    &h  = *(HeaderV1Plus *)(header + sizeof(Preheader));
+
+	if (!ph.valid()) {
+		error("signature error");
+		return false;
+	}
+
+	if (h.type == HeaderV1Plus::TYPE_FIXED) {
+		error("fixed images are not compacted");
+		return false;
+	}
+
+	if (h.blocks_offset < sizeof(Preheader) + sizeof(HeaderV1Plus) ||
+	    h.data_offset < h.blocks_offset + uint64_t(h.blocks) * sizeof(Vdi::Block::value)) {
+		error("block table location error");
+		return false;
+	}
+
+	uint32_t const sector_size = h.legacy_geometry.sector_size
+	                           ? h.legacy_geometry.sector_size
+	                           : uint32_t(Disk_geometry::SECTOR_SIZE);
+
+	/* copies of packed header fields, which cannot be passed by reference */
+	uint32_t const vdi_block_size = h.block_size;
+	uint32_t const blocks         = h.blocks;
+	uint32_t const allocated      = h.allocated_blocks;
+
+	if (sector_size < Disk_geometry::SECTOR_SIZE || (sector_size & (sector_size - 1)) ||
+	    vdi_block_size < sector_size || (vdi_block_size % sector_size)) {
+		error("unsupported block size ", vdi_block_size,
+		      " or sector size ", sector_size);
+		return false;
+	}
+
+	/* blocks needed to cover the disk size */
+	uint64_t const max_blocks = (h.disk_size + vdi_block_size - 1) / vdi_block_size;
+
+	if (blocks > max_blocks || allocated > blocks) {
+		error("block count error, blocks: ", blocks,
+		      " allocated: ", allocated, " max: ", max_blocks);
+		return false;
+	}
+
+	if (h.blocks_offset + uint64_t(h.blocks) * sizeof(Vdi::Block) >
+	    _root.file_size(_input)) {
+		error("block table exceeds file size");
+		return false;
+	}
+
+	Array_table old_table { _env.ram(), _env.rm(), h.blocks };
+	Array_table new_table { _env.ram(), _env.rm(), h.blocks };
+
+	_read(input, h.blocks_offset, old_table.content(), h.blocks * sizeof(Vdi::Block));
+
+	Vdi::Meta_data old_md { h.blocks_offset, h.data_offset, h.block_size,
+	                        h.block_size_extra, sector_size };
+	Vdi::Meta_data new_md { h.blocks_offset, h.data_offset, h.block_size,
+	                        h.block_size_extra, sector_size };
+
+	old_md.table            = &old_table;
+	old_md.max_blocks       = h.blocks;
+	old_md.allocated_blocks = h.allocated_blocks;
+
+	new_md.table            = &new_table;
+	new_md.max_blocks       = h.blocks;
+
+	size_t const block_size = size_t(h.block_size_extra) + h.block_size;
+
+	Attached_ram_dataspace block_ds { _env.ram(), _env.rm(), block_size };
+
+	char * const block = block_ds.local_addr<char>();
+
+	/*
+	 * First pass - physical blocks are handed out in LBA order, blocks of
+	 * zeros become zero blocks, which also read as zeros in
+	 * differencing images
+	 */
+	uint32_t zero_blocks = 0;
+
+	for (uint32_t bid = 0; bid < h.blocks; bid++) {
+		Vdi::Block const old = old_table.block(bid);
+
+		if (!old.allocated()) {
+			new_table.block(bid, old);
+			continue;
+		}
+
+		if (old.value >= h.allocated_blocks) {
+			error("block ", bid, " refers to invalid block ", old.value);
+			return false;
+		}
+
+		_read(input, old_md.block_offset(old.value), block, h.block_size);
+
+		if (Vdi::zero_data(block, h.block_size)) {
+			new_table.block(bid, Vdi::Block { Vdi::Block::BLOCK_ZERO });
+			zero_blocks ++;
+			continue;
+		}
+
+		new_md.alloc_block(bid, [&] (uint64_t) { return true; }, [&] { });
+	}
+
+	h.allocated_blocks = new_md.allocated_blocks;
+
+	/*
+	 * Second pass - header, new block table and the blocks in the order
+	 * of their new physical position
+	 */
+	New_file output { _root, _output };
+
+	size_t const prefix = size_t(min(uint64_t(header_size), uint64_t(h.blocks_offset)));
+
+	_append(output, header, prefix);
+	_copy(input, output, prefix, h.blocks_offset, block, block_size);
+
+	_append(output, new_table.content(), h.blocks * sizeof(Vdi::Block));
+
+	_copy(input, output, h.blocks_offset + uint64_t(h.blocks) * sizeof(Vdi::Block),
+	      h.data_offset, block, block_size);
+
+	for (uint32_t bid = 0; bid < h.blocks; bid++) {
+		if (!new_table.block(bid).allocated())
+			continue;
+
+		/* extra data in front of the block is kept */
+		_read(input, old_md.block_offset(old_table.block(bid).value) - h.block_size_extra,
+		      block, block_size);
+		_append(output, block, block_size);
+	}
+
+	log("compacted '", _input, "' to '", _output, "': ",
+	    old_md.allocated_blocks, " -> ", new_md.allocated_blocks, " blocks, ",
+	    zero_blocks, " blocks of zeros dropped");
+
+	return true;
+}
+
+
+void Component::construct(Genode::Env &env) { static Vdi_compact::Main main(env); }
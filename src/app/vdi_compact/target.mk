@@ -0,0 +1,4 @@
+TARGET  := vdi_compact
+SRC_CC  := main.cc
+LIBS    := base vfs
+INC_DIR := $(REP_DIR)/src/server/vdi_block
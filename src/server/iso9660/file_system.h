@@ -0,0 +1,415 @@
+/*
+ * \brief  File-system session front end of the ISO server
+ * \author Alexander Boettcher
+ * \date   2026-10-16
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU Affero General Public License version 3.
+ */
+
+#pragma once
+
+/* Genode includes */
+#include <base/attached_ram_dataspace.h>
+#include <file_system_session/rpc_object.h>
+#include <root/component.h>
+#include <util/reconstructible.h>
+
+/* local includes */
+#include "iso9660.h"
+
+namespace Iso {
+
+	struct Fs_buffer;
+	class  Fs_session;
+	class  Fs_root;
+
+	typedef Genode::Root_component<Fs_session> Fs_root_component;
+}
+
+
+/*
+ * Packet buffer shared with the client, allocated before the session
+ * object is constructed
+ */
+struct Iso::Fs_buffer
+{
+	Genode::Attached_ram_dataspace ds;
+
+	Fs_buffer(Genode::Env &env, Genode::size_t size) : ds(env.ram(), env.rm(), size) { }
+};
+
+
+/*
+ * Read-only session, file content is read from the block device directly
+ * into the packet buffer of the client
+ */
+class Iso::Fs_session : private Iso::Fs_buffer,
+                        public  File_system::Session_rpc_object
+{
+	private:
+
+		/*
+		 * Noncopyable
+		 */
+		Fs_session(Fs_session const &);
+		Fs_session &operator = (Fs_session const &);
+
+		enum { MAX_NODES = 64 };
+
+		using Path = Genode::String<PATH_LENGTH>;
+
+		struct Node
+		{
+			Path      const path;
+			Node_info const info;
+		};
+
+		Genode::Env         &_env;
+		Genode::Allocator   &_alloc;
+		Block::Connection<> &_block;
+
+		Genode::Constructible<Node> _nodes[MAX_NODES];
+
+		Genode::Signal_handler<Fs_session> _packet_handler {
+			_env.ep(), *this, &Fs_session::_process_packets };
+
+		File_system::Node_handle _open(Path const &path, Node_info const &info)
+		{
+			for (unsigned i = 0; i < MAX_NODES; i++) {
+				if (_nodes[i].constructed())
+					continue;
+
+				_nodes[i].construct(path, info);
+				return File_system::Node_handle(i);
+			}
+
+			throw Genode::Out_of_ram();
+		}
+
+		File_system::Node_handle _open(Path const &path, bool directory)
+		{
+			Node_info const info = _info(path);
+
+			if (info.directory != directory)
+				throw File_system::Lookup_failed();
+
+			return _open(path, info);
+		}
+
+		Node &_node(File_system::Node_handle const handle)
+		{
+			if (handle.value >= MAX_NODES || !_nodes[handle.value].constructed())
+				throw File_system::Invalid_handle();
+
+			return *_nodes[handle.value];
+		}
+
+		Node_info _info(Path const &path)
+		{
+			try {
+				return Iso::node_info(_alloc, _block, path.string(), _env.ep());
+			}
+			catch (File_not_found) { throw File_system::Lookup_failed(); }
+			catch (Io_error)       { throw File_system::Unavailable(); }
+			catch (Non_data_disc)  { throw File_system::Unavailable(); }
+		}
+
+		static Path _path(char const *path)
+		{
+			if (Genode::strlen(path) + 1 > PATH_LENGTH)
+				throw File_system::Name_too_long();
+
+			return Path(path);
+		}
+
+		static Path _join(Path const &dir, char const *name)
+		{
+			if (Genode::strlen(name) + dir.length() + 1 > PATH_LENGTH)
+				throw File_system::Name_too_long();
+
+			return Path(dir, "/", name);
+		}
+
+		/* read directory entries at a multiple of the entry size */
+		Genode::size_t _read_dir(Node const &node, Genode::uint64_t position,
+		                         char *dst, Genode::size_t length)
+		{
+			using File_system::Directory_entry;
+
+			struct Entries : Iso::Directory_entries
+			{
+				Directory_entry *dst;
+
+				Entries(char *buf) : dst((Directory_entry *)buf) { }
+
+				Entries(Entries const &) = delete;
+				Entries &operator = (Entries const &) = delete;
+
+				void entry(Node_info const &info, char const *name) override
+				{
+					Directory_entry &entry = *dst++;
+
+					entry = Directory_entry { };
+					entry.inode = info.inode;
+					entry.type  = info.directory ? File_system::Node_type::DIRECTORY
+					                             : File_system::Node_type::CONTINUOUS_FILE;
+					entry.rwx   = { .readable   = true,
+					                .writeable  = false,
+					                .executable = true };
+					Genode::copy_cstring(entry.name.buf, name, sizeof(entry.name.buf));
+				}
+			} entries { dst };
+
+			unsigned const passed =
+				Iso::directory_entries(_alloc, _block, node.path.string(),
+				                       unsigned(position / sizeof(Directory_entry)),
+				                       unsigned(length / sizeof(Directory_entry)),
+				                       entries, _env.ep());
+
+			return passed * sizeof(Directory_entry);
+		}
+
+		Genode::size_t _read_file(Node const &node, Genode::uint64_t position,
+		                          char *dst, Genode::size_t length)
+		{
+			if (position >= node.info.size)
+				return 0;
+
+			File_info info(node.info.blk_nr, node.info.size);
+
+			Genode::size_t const remaining = Genode::size_t(node.info.size - position);
+
+			return Iso::read_file(_block, &info, Genode::off_t(position),
+			                      Genode::uint32_t(Genode::min(length, remaining)),
+			                      dst, _env.ep());
+		}
+
+		void _process_packet(File_system::Packet_descriptor &packet)
+		{
+			using File_system::Packet_descriptor;
+
+			packet.succeeded(false);
+
+			switch (packet.operation()) {
+
+			case Packet_descriptor::READ:
+			{
+				Genode::size_t const length = Genode::min(packet.length(), packet.size());
+
+				if (!_tx.sink()->packet_valid(packet))
+					return;
+
+				try {
+					Node &node = _node(packet.handle());
+
+					char * const dst = _tx.sink()->packet_content(packet);
+
+					packet.length(node.info.directory
+					              ? _read_dir (node, packet.position(), dst, length)
+					              : _read_file(node, packet.position(), dst, length));
+					packet.succeeded(true);
+				}
+				catch (File_system::Invalid_handle) { }
+				catch (Io_error)                    { }
+				catch (File_not_found)              { }
+				catch (Non_data_disc)               { }
+				return;
+			}
+
+			case Packet_descriptor::READ_READY:
+			case Packet_descriptor::SYNC:
+				packet.succeeded(true);
+				return;
+
+			case Packet_descriptor::WRITE:
+			case Packet_descriptor::CONTENT_CHANGED:
+			case Packet_descriptor::WRITE_TIMESTAMP:
+				return;
+			}
+		}
+
+		void _process_packets()
+		{
+			auto &sink = *_tx.sink();
+
+			while (sink.packet_avail() && sink.ready_to_ack()) {
+				File_system::Packet_descriptor packet = sink.get_packet();
+
+				_process_packet(packet);
+
+				sink.acknowledge_packet(packet);
+			}
+		}
+
+	public:
+
+		Fs_session(Genode::Env &env, Genode::Allocator &alloc,
+		           Block::Connection<> &block, Genode::size_t tx_buf_size)
+		:
+			Fs_buffer(env, tx_buf_size),
+			Session_rpc_object(Fs_buffer::ds.cap(), env.rm(), env.ep().rpc_ep()),
+			_env(env), _alloc(alloc), _block(block)
+		{
+			_tx.sigh_packet_avail(_packet_handler);
+			_tx.sigh_ready_to_ack(_packet_handler);
+		}
+
+
+		/***************************
+		 ** File_system interface **
+		 ***************************/
+
+		File_system::File_handle file(File_system::Dir_handle dir,
+		                              File_system::Name const &name,
+		                              File_system::Mode mode, bool create) override
+		{
+			if (create || mode == File_system::WRITE_ONLY
+			           || mode == File_system::READ_WRITE)
+				throw File_system::Permission_denied();
+
+			File_system::Node_handle const handle =
+				_open(_join(_node(dir).path, name.string()), false);
+
+			return File_system::File_handle(handle.value);
+		}
+
+		File_system::Symlink_handle symlink(File_system::Dir_handle,
+		                                    File_system::Name const &,
+		                                    bool create) override
+		{
+			if (create)
+				throw File_system::Permission_denied();
+
+			throw File_system::Lookup_failed();
+		}
+
+		File_system::Dir_handle dir(File_system::Path const &path, bool create) override
+		{
+			if (create)
+				throw File_system::Permission_denied();
+
+			File_system::Node_handle const handle = _open(_path(path.string()), true);
+
+			return File_system::Dir_handle(handle.value);
+		}
+
+		File_system::Node_handle node(File_system::Path const &path) override
+		{
+			Path const p = _path(path.string());
+
+			return _open(p, _info(p));
+		}
+
+		File_system::Watch_handle watch(File_system::Path const &) override {
+			throw File_system::Unavailable(); }
+
+		void close(File_system::Node_handle handle) override
+		{
+			if (handle.value < MAX_NODES)
+				_nodes[handle.value].destruct();
+		}
+
+		File_system::Status status(File_system::Node_handle handle) override
+		{
+			Node const &node = _node(handle);
+
+			File_system::file_size_t size = node.info.size;
+
+			/* directories report the size of their entries */
+			if (node.info.directory)
+				size = sizeof(File_system::Directory_entry) *
+				       num_entries(File_system::Dir_handle(handle.value));
+
+			return File_system::Status {
+				.size              = size,
+				.type              = node.info.directory
+				                   ? File_system::Node_type::DIRECTORY
+				                   : File_system::Node_type::CONTINUOUS_FILE,
+				.rwx               = { .readable   = true,
+				                       .writeable  = false,
+				                       .executable = true },
+				.inode             = node.info.inode,
+				.modification_time = { File_system::Timestamp::INVALID }
+			};
+		}
+
+		void control(File_system::Node_handle, File_system::Control) override { }
+
+		void unlink(File_system::Dir_handle, File_system::Name const &) override {
+			throw File_system::Permission_denied(); }
+
+		void truncate(File_system::File_handle, File_system::file_size_t) override {
+			throw File_system::Permission_denied(); }
+
+		void move(File_system::Dir_handle, File_system::Name const &,
+		          File_system::Dir_handle, File_system::Name const &) override {
+			throw File_system::Permission_denied(); }
+
+		unsigned num_entries(File_system::Dir_handle dir) override
+		{
+			Node const &node = _node(dir);
+
+			if (!node.info.directory)
+				throw File_system::Invalid_handle();
+
+			try {
+				return Iso::num_entries(_alloc, _block, node.path.string(), _env.ep());
+			}
+			catch (File_not_found) { throw File_system::Lookup_failed(); }
+			catch (Io_error)       { throw File_system::Unavailable(); }
+			catch (Non_data_disc)  { throw File_system::Unavailable(); }
+		}
+};
+
+
+class Iso::Fs_root : public Iso::Fs_root_component
+{
+	private:
+
+		enum { SESSION_CAPS = 4 };
+
+		Genode::Env         &_env;
+		Genode::Allocator   &_alloc;
+		Block::Connection<> &_block;
+
+	protected:
+
+		Create_result _create_session(const char *args) override
+		{
+			using namespace Genode;
+
+			size_t const ram_quota =
+				Arg_string::find_arg(args, "ram_quota").ulong_value(0);
+			size_t const cap_quota =
+				Arg_string::find_arg(args, "cap_quota").ulong_value(0);
+			size_t const tx_buf_size =
+				Arg_string::find_arg(args, "tx_buf_size").ulong_value(0);
+
+			if (!tx_buf_size)
+				throw Service_denied();
+
+			/* account for the session object and the tx buffer */
+			size_t const session_size = max((size_t)4096, sizeof(Fs_session));
+			if (session_size + tx_buf_size > ram_quota)
+				throw Insufficient_ram_quota();
+
+			/* tx buffer, session object and packet-stream signal handler */
+			if (cap_quota < SESSION_CAPS)
+				throw Insufficient_cap_quota();
+
+			return *new (_alloc) Fs_session(_env, _alloc, _block, tx_buf_size);
+		}
+
+	public:
+
+		Fs_root(Genode::Env &env, Genode::Allocator &alloc, Block::Connection<> &block)
+		:
+			Fs_root_component(&env.ep().rpc_ep(), &alloc),
+			_env(env), _alloc(alloc), _block(block)
+		{ }
+};
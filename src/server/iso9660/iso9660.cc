@@ -16,6 +16,8 @@
 #include <base/exception.h>
 #include <base/log.h>
 #include <base/stdint.h>
+#include <util/dictionary.h>
+#include <util/list.h>
 #include <util/misc_math.h>
 #include <util/token.h>
 
@@ -27,6 +29,10 @@ namespace Iso {
 	class Sector;
 	class Rock_ridge;
 	class Iso_base;
+	class Entry;
+
+	using Entry_path  = Genode::String<PATH_LENGTH>;
+	using Entry_index = Genode::Dictionary<Entry, Entry_path>;
 }
 
 
@@ -37,11 +43,7 @@ class Iso::Sector {
 
 	public:
 
-		enum {
-			MAX_SECTORS = 32, /* max. number sectors that can be read in one
-			                     transaction */
-			BLOCK_SIZE = 2048,
-		};
+		enum { BLOCK_SIZE = 2048 };
 
 	private:
 
@@ -59,8 +61,7 @@ class Iso::Sector {
 				_p = Block::Packet_descriptor(
 					block.alloc_packet(blk_size() * count),
 					Block::Packet_descriptor::READ,
-					blk_nr * ((float)blk_size() / (float) BLOCK_SIZE),
-					count * ((float)blk_size() / (float) BLOCK_SIZE));
+					to_dev(blk_nr), to_dev(count));
 
 				while (!_source.ready_to_submit())
 					ep.wait_and_dispatch_one_io_signal();
@@ -98,6 +99,13 @@ class Iso::Sector {
 
 		static unsigned long to_blk(unsigned long bytes) {
 			return ((bytes + blk_size() - 1) & ~(blk_size() - 1)) / blk_size(); }
+
+		/* conversion between ISO sectors and blocks of the device */
+		static Block::sector_t to_dev(unsigned long blk) {
+			return blk * ((float)blk_size() / (float) BLOCK_SIZE); }
+
+		static unsigned long from_dev(Block::sector_t blk) {
+			return (unsigned long)(blk * ((float) BLOCK_SIZE / (float)blk_size())); }
 };
 
 
@@ -285,6 +293,10 @@ class Directory_record : public Iso::Iso_base
 
 		/* describes this record a directory */
 		bool directory() { return file_flags() & DIR_FLAG; }
+
+		/* record of the directory itself or of its parent */
+		bool dot_entry() {
+			return file_name_length() == 1 && value<uint8_t>(33) <= PARENT_DIR; }
 };
 
 
@@ -371,17 +383,145 @@ static Directory_record *root_dir(Genode::Allocator &alloc,
 }
 
 
+/**
+ * Entry of the path index, keyed by the absolute path on the ISO
+ */
+class Iso::Entry : public Entry_index::Element, public List<Entry>::Element
+{
+	public:
+
+		uint32_t const blk_nr;
+		uint32_t const length;
+		bool     const directory;
+
+		/* entries of the directory are in the index */
+		bool scanned = false;
+
+		/* entries of the directory in the order of their records */
+		List<Entry> entries     { };
+		Entry      *last_entry  { nullptr };
+		unsigned    num_entries { 0 };
+
+		/* entry following the last one read and its index */
+		Entry      *cursor       { nullptr };
+		unsigned    cursor_index { 0 };
+
+		Entry(Entry_index &index, Entry_path const &path,
+		      uint32_t blk_nr, uint32_t length, bool directory)
+		:
+			Entry_index::Element(index, path),
+			blk_nr(blk_nr), length(length), directory(directory)
+		{ }
+
+		void append(Entry &entry)
+		{
+			entries.insert(&entry, last_entry);
+			last_entry = &entry;
+			num_entries ++;
+		}
+
+		/* last element of the path */
+		char const *file_name() const
+		{
+			char const *last = name.string();
+
+			for (char const *s = last; *s; s++)
+				if (*s == '/') last = s + 1;
+
+			return last;
+		}
+
+		Iso::Node_info info() const {
+			return { blk_nr, length, directory, (unsigned long)(addr_t)this }; }
+};
+
+
+/**
+ * Add all records of a directory extent to the index
+ */
+static void scan_directory(Genode::Allocator &alloc, Block::Connection<> &block,
+                           Iso::Entry_index &index, Iso::Entry &dir,
+                           Genode::Entrypoint &ep)
+{
+	using Iso::Sector;
+
+	if (!dir.length)
+		return;
+
+	alloc.try_alloc(dir.length).with_result(
+
+		[&] (auto &a) {
+			uint8_t * const buf = (uint8_t *)a.ptr;
+
+			Iso::File_info extent(dir.blk_nr, dir.length);
+			Iso::read_file(block, &extent, 0, dir.length, buf, ep);
+
+			/* records do not cross sector boundaries */
+			for (size_t sec = 0; sec < dir.length; sec += Sector::blk_size()) {
+
+				size_t const sec_end = min(sec + Sector::blk_size(), size_t(dir.length));
+
+				for (size_t off = sec; off < sec_end; ) {
+
+					Directory_record *record = (Directory_record *)(buf + off);
+
+					/* the rest of the sector is padded with zeros */
+					uint8_t const record_length = record->record_length();
+					if (!record_length || off + record_length > sec_end)
+						break;
+
+					off += record_length;
+
+					if (record->dot_entry())
+						continue;
+
+					/* Rock Ridge names may be up to 250 characters */
+					char name[256];
+					record->file_name(name);
+
+					if (dir.name.length() + strlen(name) + 1 > Iso::PATH_LENGTH)
+						continue;
+
+					Iso::Entry_path const path(dir.name, "/", Cstring(name));
+
+					/* multi-extent files have several records */
+					if (index.exists(path))
+						continue;
+
+					dir.append(*new (alloc) Iso::Entry(index, path, record->blk_nr(),
+					                                   record->data_length(),
+					                                   record->directory()));
+				}
+			}
+		},
+
+		[&] (auto) {
+			error("out of memory while reading directory ", dir.name);
+			throw Iso::Io_error();
+		}
+	);
+}
+
+
 /*******************
  ** Iso interface **
  *******************/
 
 static Directory_record *_root_dir;
 
+/*
+ * Directories are read once on the first lookup of one of their entries,
+ * subsequent lookups are answered from the index without I/O
+ */
+static Iso::Entry_index  _index { };
+static Iso::Entry       *_root_entry;
 
-Iso::File_info *Iso::file_info(Genode::Allocator &alloc,
-                               Block::Connection<> &block, char const *path,
-                               Genode::Entrypoint &ep)
+
+static Iso::Entry &lookup(Genode::Allocator &alloc, Block::Connection<> &block,
+                          char const *path, Genode::Entrypoint &ep)
 {
+	using namespace Iso;
+
 	char level[PATH_LENGTH];
 
 	struct Scanner_policy_file
@@ -404,10 +544,13 @@ Iso::File_info *Iso::file_info(Genode::Allocator &alloc,
 		_root_dir = root_dir(alloc, block, ep);
 	}
 
-	Directory_record *dir = _root_dir;
-	uint32_t blk_nr = 0, data_length = 0;
+	if (!_root_entry)
+		_root_entry = new (alloc) Entry(_index, Entry_path(), _root_dir->blk_nr(),
+		                                _root_dir->data_length(), true);
 
-	/* determine block nr and file length on disk, parse directory records */
+	Entry *entry = _root_entry;
+
+	/* walk the path, directories not indexed yet are read on the way */
 	while (t) {
 
 		if (t.type() != Token::IDENT) {
@@ -417,80 +560,215 @@ Iso::File_info *Iso::file_info(Genode::Allocator &alloc,
 
 		t.string(level, PATH_LENGTH);
 
-		/*
-		 * Save current block number in a variable because successive
-		 * iterations might override the memory location where dir points
-		 * to when a directory entry spans several sectors.
-		 */
-		uint32_t current_blk_nr = dir->blk_nr();
+		if (!entry->directory)
+			throw File_not_found();
+
+		if (!entry->scanned) {
+			scan_directory(alloc, block, _index, *entry, ep);
+			entry->scanned = true;
+		}
 
-		/* load extent of directory record and search for level */
-		for (unsigned long i = 0; i < Sector::to_blk(dir->data_length()); i++) {
-			Sector sec(block, current_blk_nr + i, 1, ep);
-			Directory_record *tmp = sec.addr<Directory_record *>()->locate(level);
+		Entry_path const level_path(entry->name, "/", Cstring(level));
 
-			if (!tmp && i == Sector::to_blk(dir->data_length()) - 1) {
-				Genode::error("file not found: ", Genode::Cstring(path));
-				throw File_not_found();
-			}
+		entry = _index.with_element(level_path,
+			[&] (Entry &e) -> Entry * { return &e; },
+			[&] ()         -> Entry * { return nullptr; });
 
-			if (!tmp) continue;
+		if (!entry)
+			throw File_not_found();
 
-			dir = tmp;
-			current_blk_nr = dir->blk_nr();
+		t = t.next();
+	}
 
-			if (!dir->directory()) {
-				blk_nr      = current_blk_nr;
-				data_length = dir->data_length();
-			}
+	return *entry;
+}
 
-			break;
-		}
 
-		t = t.next();
+/*
+ * Directory at 'path' with all its entries in the index
+ */
+static Iso::Entry &lookup_directory(Genode::Allocator &alloc, Block::Connection<> &block,
+                                    char const *path, Genode::Entrypoint &ep)
+{
+	Iso::Entry &dir = lookup(alloc, block, path, ep);
+
+	if (!dir.directory)
+		throw Iso::File_not_found();
+
+	if (!dir.scanned) {
+		scan_directory(alloc, block, _index, dir, ep);
+		dir.scanned = true;
 	}
 
-	/* Warning: Don't access 'dir' after this point, since the sector is gone */
+	return dir;
+}
+
+
+Iso::File_info *Iso::file_info(Genode::Allocator &alloc,
+                               Block::Connection<> &block, char const *path,
+                               Genode::Entrypoint &ep)
+{
+	try {
+		Entry &entry = lookup(alloc, block, path, ep);
+
+		if (!entry.directory)
+			return new (alloc) File_info(entry.blk_nr, entry.length);
+	} catch (File_not_found) { }
+
+	Genode::error("file not found: ", Genode::Cstring(path));
+	throw File_not_found();
+}
+
+
+Iso::Node_info Iso::node_info(Genode::Allocator &alloc,
+                              Block::Connection<> &block, char const *path,
+                              Genode::Entrypoint &ep)
+{
+	return lookup(alloc, block, path, ep).info();
+}
+
+
+unsigned Iso::num_entries(Genode::Allocator &alloc,
+                          Block::Connection<> &block, char const *path,
+                          Genode::Entrypoint &ep)
+{
+	return lookup_directory(alloc, block, path, ep).num_entries;
+}
+
 
-	if (!blk_nr && !data_length) {
-		Genode::error("file not found: ", Genode::Cstring(path));
-		throw File_not_found();
+unsigned Iso::directory_entries(Genode::Allocator &alloc,
+                                Block::Connection<> &block, char const *path,
+                                unsigned index, unsigned count,
+                                Directory_entries &entries,
+                                Genode::Entrypoint &ep)
+{
+	Entry &dir = lookup_directory(alloc, block, path, ep);
+
+	Entry   *entry = dir.entries.first();
+	unsigned i     = 0;
+
+	/* sequential reads continue at the cursor */
+	if (dir.cursor && dir.cursor_index <= index) {
+		entry = dir.cursor;
+		i     = dir.cursor_index;
 	}
 
-	return new (alloc) File_info(blk_nr, data_length);
+	for (; entry && i < index; i++)
+		entry = entry->next();
+
+	unsigned passed = 0;
+
+	for (; entry && passed < count; entry = entry->next(), i++, passed++)
+		entries.entry(entry->info(), entry->file_name());
+
+	dir.cursor       = entry;
+	dir.cursor_index = i;
+
+	return passed;
 }
 
 
+/*
+ * Read extent range in chunks of a fraction of the tx buffer, packets are
+ * submitted as long as the submit queue and the tx buffer permit and
+ * their content is copied to 'buf' as they get acknowledged
+ */
 unsigned long Iso::read_file(Block::Connection<> &block, File_info *info,
                              off_t file_offset, uint32_t length, void *buf_ptr,
                              Genode::Entrypoint &ep)
 {
+	enum { PIPELINE_DEPTH = 8 };
+
 	uint8_t *buf = (uint8_t *)buf_ptr;
-	if (info->size() <= (size_t)(length + file_offset))
-		length = info->size() - file_offset - 1;
 
-	unsigned long total_blk_count = ((length + (Sector::blk_size() - 1)) &
-	                                 ~((Sector::blk_size()) - 1)) / Sector::blk_size();
-	unsigned long ret = total_blk_count;
-	unsigned long blk_count;
-	unsigned long blk_nr = info->blk_nr() + (file_offset / Sector::blk_size());
+	if ((size_t)file_offset >= info->size())
+		return 0;
+
+	if (info->size() < (size_t)(length + file_offset))
+		length = uint32_t(info->size() - file_offset);
+
+	Block::Session::Tx::Source &source = *block.tx();
 
-	while ((blk_count = min<unsigned long>(Sector::MAX_SECTORS, total_blk_count))) {
-		Sector sec(block, blk_nr, blk_count, ep);
+	size_t const chunk = max(Sector::blk_size(),
+	                         (source.bulk_buffer_size() / PIPELINE_DEPTH) &
+	                         ~(Sector::blk_size() - 1));
 
-		total_blk_count -= blk_count;
-		blk_nr          += blk_count;
+	unsigned long const first     = file_offset / Sector::blk_size();
+	unsigned long const end       = Sector::to_blk(file_offset + length);
+	unsigned long       submitted = first;
+	unsigned long       completed = 0;
+	unsigned            in_flight = 0;
+	bool                failed    = false;
 
-		unsigned long copy_length = blk_count * Sector::blk_size();
-		memcpy(buf, sec.addr<void *>(), copy_length);
+	while (completed < end - first) {
 
-		length -= copy_length;
-		buf    += copy_length;
+		/* keep the submit queue filled */
+		while (submitted < end && !failed && source.ready_to_submit()) {
 
-		/* zero out rest of page */
-		if (!total_blk_count && (blk_count % 2))
-			bzero(buf, Sector::blk_size());
+			unsigned long const count = min<unsigned long>(chunk / Sector::blk_size(),
+			                                               end - submitted);
+			Block::Packet_descriptor p;
+
+			try {
+				p = Block::Packet_descriptor(
+					block.alloc_packet(count * Sector::blk_size()),
+					Block::Packet_descriptor::READ,
+					Sector::to_dev(info->blk_nr() + submitted),
+					Sector::to_dev(count));
+			} catch (Block::Session::Tx::Source::Packet_alloc_failed) {
+				/* tx buffer exhausted, wait for acknowledgements */
+				if (!in_flight) {
+					Genode::error("packet overrun!");
+					throw Io_error();
+				}
+				break;
+			}
+
+			source.submit_packet(p);
+
+			submitted += count;
+			in_flight ++;
+		}
+
+		if (!source.ack_avail()) {
+			ep.wait_and_dispatch_one_io_signal();
+			continue;
+		}
+
+		while (source.ack_avail()) {
+			Block::Packet_descriptor const p = source.get_acked_packet();
+
+			unsigned long const blk   = Sector::from_dev(p.block_number()) - info->blk_nr();
+			unsigned long const count = Sector::from_dev(p.block_count());
+
+			if (!p.succeeded()) {
+				Genode::error("Could not read block ", info->blk_nr() + blk);
+				failed = true;
+
+				/* nothing more is submitted, account for the rest */
+				completed += end - submitted;
+				submitted  = end;
+			} else {
+				/* copy the part of the requested range within the packet */
+				uint64_t const from = max(uint64_t(blk * Sector::blk_size()),
+				                          uint64_t(file_offset));
+				uint64_t const to   = min(uint64_t((blk + count) * Sector::blk_size()),
+				                          uint64_t(file_offset) + length);
+
+				memcpy(buf + (from - file_offset),
+				       source.packet_content(p) + (from - blk * Sector::blk_size()),
+				       size_t(to - from));
+			}
+
+			source.release_packet(p);
+
+			completed += count;
+			in_flight --;
+		}
 	}
 
-	return ret * Sector::blk_size();
+	if (failed)
+		throw Io_error();
+
+	return length;
 }
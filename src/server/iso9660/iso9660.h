@@ -11,6 +11,9 @@
  * under the terms of the GNU Affero General Public License version 3.
  */
 
+#ifndef _ISO9660_H_
+#define _ISO9660_H_
+
 /* Genode includes */
 #include <base/stdint.h>
 #include <block_session/connection.h>
@@ -52,6 +55,15 @@ namespace Iso {
 	};
 
 
+	struct Node_info
+	{
+		Genode::uint32_t blk_nr;
+		Genode::size_t   size;
+		bool             directory;
+		unsigned long    inode;
+	};
+
+
 	/*******************
 	 ** Iso interface **
 	 *******************/
@@ -59,6 +71,9 @@ namespace Iso {
 	/**
 	 * Retrieve file information
 	 *
+	 * Directories along the path are read on first use and kept in an
+	 * index, so that later lookups require no I/O.
+	 *
 	 * \param alloc allocator used for File_info object
 	 * \param block Block session used to read sectors from ISO
 	 * \param path  absolute path of the file (slash separated)
@@ -72,6 +87,57 @@ namespace Iso {
 	File_info *file_info(Genode::Allocator &alloc, Block::Connection<> &block,
 	                     char const *path, Genode::Entrypoint &);
 
+	/**
+	 * Retrieve information about a file or directory
+	 *
+	 * \param alloc allocator used for the index
+	 * \param block Block session used to read sectors from ISO
+	 * \param path  absolute path of the node (slash separated)
+	 *
+	 * \throw File_not_found
+	 * \throw Io_error
+	 * \throw Non_data_disc
+	 */
+	Node_info node_info(Genode::Allocator &alloc, Block::Connection<> &block,
+	                    char const *path, Genode::Entrypoint &);
+
+	/**
+	 * Return number of entries of directory at 'path'
+	 *
+	 * \throw File_not_found
+	 * \throw Io_error
+	 * \throw Non_data_disc
+	 */
+	unsigned num_entries(Genode::Allocator &alloc, Block::Connection<> &block,
+	                     char const *path, Genode::Entrypoint &);
+
+	/**
+	 * Receiver of directory entries
+	 */
+	struct Directory_entries : Genode::Interface
+	{
+		virtual void entry(Node_info const &info, char const *name) = 0;
+	};
+
+	/**
+	 * Pass entries of directory at 'path' to 'entries'
+	 *
+	 * Reads continuing at the entry following the previous read do not
+	 * walk the entries before.
+	 *
+	 * \param index  index of the first entry in the directory
+	 * \param count  max. number of entries
+	 *
+	 * \throw File_not_found
+	 * \throw Io_error
+	 * \throw Non_data_disc
+	 *
+	 * \return number of entries passed
+	 */
+	unsigned directory_entries(Genode::Allocator &alloc, Block::Connection<> &block,
+	                           char const *path, unsigned index, unsigned count,
+	                           Directory_entries &entries, Genode::Entrypoint &);
+
 	/**
 	 * Read data from ISO
 	 *
@@ -89,3 +155,5 @@ namespace Iso {
 	                        Genode::off_t file_offset, Genode::uint32_t length,
 	                        void *buf, Genode::Entrypoint &);
 } /* namespace Iso */
+
+#endif /* _ISO9660_H_ */
@@ -20,11 +20,17 @@
 #include <root/component.h>
 #include <util/dictionary.h>
 #include <base/attached_ram_dataspace.h>
+#include <base/attached_rom_dataspace.h>
 #include <base/session_label.h>
 #include <block_session/connection.h>
+#include <os/reporter.h>
+#include <region_map/client.h>
+#include <rm_session/connection.h>
 #include <rom_session/rom_session.h>
+#include <util/list.h>
 
 /* local includes */
+#include "file_system.h"
 #include "iso9660.h"
 
 using namespace Genode;
@@ -37,6 +43,7 @@ using namespace Genode;
 namespace Iso {
 
 	class File;
+	struct File_budget;
 
 	using File_name  = String<PATH_LENGTH>;
 	using File_cache = Dictionary<File, File_name>;
@@ -48,8 +55,27 @@ namespace Iso {
 }
 
 
+/*
+ * RAM budget shared by all files, which may evict files without ROM
+ * session to make room
+ */
+struct Iso::File_budget : Genode::Interface
+{
+	/* return true if 'size' bytes may be allocated for 'file' */
+	virtual bool reserve(File const &file, size_t size) = 0;
+
+	/* a page fault of 'file' got resolved */
+	virtual void resolved(File const &file) = 0;
+};
+
+
 /**
  * File abstraction
+ *
+ * The dataspace of a file is a managed dataspace, its content is read
+ * from the ISO in chunks on the first page fault within a chunk. The RAM
+ * is allocated in larger units, since each RAM dataspace costs a
+ * capability.
  */
 class Iso::File : public File_cache::Element
 {
@@ -61,26 +87,183 @@ class Iso::File : public File_cache::Element
 		File(File const &);
 		File &operator = (File const &);
 
+		/* granularity of reads and attachments */
+		enum { CHUNK_SIZE = 64*1024 };
+
+		/* granularity of RAM allocations */
+		enum { UNIT_SIZE = 1024*1024 };
+
+		struct Unit : List<Unit>::Element
+		{
+			Attached_ram_dataspace ds;
+			addr_t const           offset; /* within the file */
+
+			Unit(Genode::Env &env, addr_t offset, size_t size)
+			: ds(env.ram(), env.rm(), size), offset(offset) { }
+		};
+
+		Genode::Env              &_env;
 		Genode::Allocator        &_alloc;
+		Rm_connection            &_rm;
+		Block::Connection<>      &_block;
+		File_budget              &_budget;
 
 		File_info                *_info;
-		Attached_ram_dataspace    _ds;
+		size_t const              _size { max(_info->page_sized(), size_t(PAGE_SIZE)) };
+		Region_map_client         _map  { _rm.create(_size) };
+		List<Unit>                _units  { };
+		size_t                    _ram    { 0 };
+
+		/* ROM sessions of the file and time of the last request */
+		unsigned                  _refs     { 0 };
+		uint64_t                  _last_use { 0 };
+
+		/* a fault could not be resolved, the client waits for a retry */
+		bool                      _stalled  { false };
+
+		Signal_handler<File>      _fault_handler { _env.ep(), *this, &File::_handle_fault };
+
+		Unit *_unit(addr_t const offset)
+		{
+			for (Unit *unit = _units.first(); unit; unit = unit->next())
+				if (unit->offset == offset) return unit;
+
+			size_t const size = min(size_t(UNIT_SIZE), _size - offset);
+
+			if (!_budget.reserve(*this, size)) {
+				error("RAM budget exceeded by file ", name);
+				return nullptr;
+			}
+
+			try {
+				Unit &unit = *new (_alloc) Unit(_env, offset, size);
+
+				_units.insert(&unit);
+				_ram += size;
+				return &unit;
+			}
+			catch (Out_of_ram)  { error("out of RAM for file ", name); }
+			catch (Out_of_caps) { error("out of caps for file ", name); }
+
+			return nullptr;
+		}
+
+		/* attach range of 'unit', the region map is upgraded on demand */
+		bool _attach(Unit &unit, addr_t const offset, size_t const size)
+		{
+			using Error = Region_map::Attach_error;
+
+			for (unsigned i = 0; i < 2; i++) {
+
+				bool retry = false;
+
+				bool const attached = _map.attach(unit.ds.cap(), {
+					.size       = size,
+					.offset     = offset - unit.offset,
+					.use_at     = true,
+					.at         = offset,
+					.executable = true,
+					.writeable  = false
+				}).convert<bool>(
+					[&] (Region_map::Range) { return true; },
+					[&] (Error e) {
+						if (e == Error::OUT_OF_RAM)  { _rm.upgrade_ram(8*1024); retry = true; }
+						if (e == Error::OUT_OF_CAPS) { _rm.upgrade_caps(2);     retry = true; }
+						return false; });
+
+				if (attached || !retry)
+					return attached;
+			}
+			return false;
+		}
+
+		/* read chunk containing 'addr' and attach it to the managed dataspace */
+		bool _resolve(addr_t const addr)
+		{
+			addr_t const offset = addr & ~(addr_t(CHUNK_SIZE) - 1);
+
+			if (offset >= _size)
+				return false;
+
+			size_t const size = min(size_t(CHUNK_SIZE), _size - offset);
+
+			Unit * const unit = _unit(offset & ~(addr_t(UNIT_SIZE) - 1));
+			if (!unit)
+				return false;
+
+			try {
+				Iso::read_file(_block, _info, offset, uint32_t(size),
+				               unit->ds.local_addr<char>() + (offset - unit->offset),
+				               _env.ep());
+			} catch (...) {
+				error("reading file ", name, " failed");
+				return false;
+			}
+
+			return _attach(*unit, offset, size);
+		}
+
+		void _handle_fault()
+		{
+			for (;;) {
+				Region_map::Fault const fault = _map.fault();
+
+				if (fault.type == Region_map::Fault::Type::NONE) {
+					_stalled = false;
+					_budget.resolved(*this);
+					return;
+				}
+
+				if (!_resolve(fault.addr)) {
+					if (!_stalled)
+						error("unable to resolve fault at ", Hex(fault.addr),
+						      " of file ", name, ", retrying when memory is freed");
+					_stalled = true;
+					return;
+				}
+			}
+		}
 
 	public:
 
 		File(Genode::Env &env, Genode::Allocator &alloc, File_cache &file_cache,
-		     Block::Connection<> &block, char const *path)
+		     Rm_connection &rm, Block::Connection<> &block, File_budget &budget,
+		     char const *path)
 		:
-			File_cache::Element(file_cache, path), _alloc(alloc),
-			_info(Iso::file_info(_alloc, block, path, env.ep())),
-			_ds(env.ram(), env.rm(), align_addr(_info->page_sized(), { .log2 = 12 }))
+			File_cache::Element(file_cache, path), _env(env), _alloc(alloc),
+			_rm(rm), _block(block), _budget(budget),
+			_info(Iso::file_info(_alloc, block, path, env.ep()))
 		{
-			Iso::read_file(block, _info, 0, _ds.size(), _ds.local_addr<void>(), env.ep());
+			_map.fault_handler(_fault_handler);
 		}
-		
-		~File() { destroy(_alloc, _info); }
 
-		Dataspace_capability dataspace() { return _ds.cap(); }
+		~File()
+		{
+			_rm.destroy(_map);
+
+			while (Unit *unit = _units.first()) {
+				_units.remove(unit);
+				destroy(_alloc, unit);
+			}
+
+			destroy(_alloc, _info);
+		}
+
+		/* resolve a stalled fault again from the signal handler */
+		void retry() const
+		{
+			if (_stalled)
+				Signal_transmitter(_fault_handler).submit();
+		}
+
+		Dataspace_capability dataspace() { return _map.dataspace(); }
+
+		void acquire(uint64_t const now) { _refs ++; _last_use = now; }
+		void release()                   { _refs --; }
+
+		bool     unused()   const { return !_refs; }
+		uint64_t last_use() const { return _last_use; }
+		size_t   ram()      const { return _ram; }
 };
 
 
@@ -94,55 +277,143 @@ class Iso::Rom_component : public Genode::Rpc_object<Rom_session>
 		Rom_component(Rom_component const &);
 		Rom_component &operator = (Rom_component const &);
 
-		File *_file_ptr = nullptr;
+		File &_file;
 
 	public:
 
+		/* RAM quota of the session available for file content */
+		size_t const quota;
+
 		Rom_dataspace_capability dataspace() override {
-			return static_cap_cast<Rom_dataspace>(_file_ptr->dataspace()); }
+			return static_cap_cast<Rom_dataspace>(_file.dataspace()); }
 
 		void sigh(Signal_context_capability) override { }
 
-		Rom_component(Genode::Env &env, Genode::Allocator &alloc,
-		              File_cache &file_cache, Block::Connection<> &block,
-		              char const *path)
+		Rom_component(File &file, uint64_t const now, size_t const quota)
+		: _file(file), quota(quota)
 		{
-			file_cache.with_element(path,
-
-				[&] (File &file) {
-					log("cache hit for file ", path);
-					_file_ptr = &file;
-				},
-
-				[&] {
-					log("request for file ", path);
-					_file_ptr = new (alloc) File(env, alloc, file_cache, block, path);
-				});
+			_file.acquire(now);
 		}
+
+		~Rom_component() { _file.release(); }
 };
 
 
-class Iso::Root : public Iso::Root_component
+class Iso::Root : public Iso::Root_component, private Iso::File_budget
 {
 	private:
 
 		Genode::Env       &_env;
 		Genode::Allocator &_alloc;
 
-		Allocator_avl       _block_alloc { &_alloc };
-		Block::Connection<> _block       { _env, &_block_alloc };
+		Block::Connection<> &_block;
 
-		Genode::Io_signal_handler<Root>  sigh { _env.ep(), *this, &Root::_signal };
+		/* region maps of the file dataspaces */
+		Rm_connection _rm { _env };
 
 		/*
-		 * Entries in the cache are never freed, even if the ROM session
-		 * gets destroyed.
+		 * Files without ROM session stay in the cache until the RAM used by
+		 * all files exceeds the limit, the least recently requested ones are
+		 * evicted first. The limit is the configured one plus the RAM quota
+		 * donated by the ROM sessions.
 		 */
 		File_cache _cache { };
 
+		size_t const _cache_limit;
+		size_t       _donated   { 0 };
+		uint64_t     _requests  { 0 };
+		uint64_t     _hits      { 0 };
+		uint64_t     _misses    { 0 };
+		uint64_t     _evictions { 0 };
+
+		Constructible<Expanding_reporter> _reporter { };
+
 		char _path[PATH_LENGTH];
 
-		void _signal() { }
+		File &_file(char const *path)
+		{
+			return _cache.with_element(path,
+
+				[&] (File &file) -> File & {
+					log("cache hit for file ", path);
+					_hits ++;
+					return file;
+				},
+
+				[&] () -> File & {
+					log("request for file ", path);
+					_misses ++;
+					return *new (_alloc) File(_env, _alloc, _cache, _rm, _block,
+					                          *this, path);
+				});
+		}
+
+		size_t _limit() const { return _cache_limit + _donated; }
+
+		size_t _ram() const
+		{
+			size_t ram = 0;
+			_cache.for_each([&] (File const &file) { ram += file.ram(); });
+			return ram;
+		}
+
+		/* evict files until 'needed' bytes fit, 'keep' is not evicted */
+		void _evict(File const *keep = nullptr, size_t const needed = 0)
+		{
+			for (;;) {
+				size_t      ram = 0;
+				File const *lru = nullptr;
+
+				_cache.for_each([&] (File const &file) {
+					ram += file.ram();
+
+					if (file.unused() && &file != keep &&
+					    (!lru || file.last_use() < lru->last_use()))
+						lru = &file;
+				});
+
+				if (ram + needed <= _limit() || !lru)
+					return;
+
+				File_name const name = lru->name;
+
+				_cache.with_element(name,
+					[&] (File &file) { destroy(_alloc, &file); },
+					[&] { });
+
+				_evictions ++;
+			}
+		}
+
+		void _report()
+		{
+			if (!_reporter.constructed())
+				return;
+
+			unsigned files = 0;
+			_cache.for_each([&] (File const &) { files ++; });
+
+			_reporter->generate([&] (Genode::Generator &g) {
+				g.attribute("files",     files);
+				g.attribute("ram",       _ram());
+				g.attribute("limit",     _limit());
+				g.attribute("hits",      _hits);
+				g.attribute("misses",    _misses);
+				g.attribute("evictions", _evictions);
+			});
+		}
+
+		/*
+		 * File_budget interface
+		 */
+
+		bool reserve(File const &file, size_t const size) override
+		{
+			_evict(&file, size);
+			return _ram() + size <= _limit();
+		}
+
+		void resolved(File const &) override { _report(); }
 
 	protected:
 
@@ -158,40 +429,100 @@ class Iso::Root : public Iso::Root_component
 			Session_label const label = label_from_args(args);
 			copy_cstring(_path, label.last_element().string(), sizeof(_path));
 
-			_block.tx_channel()->sigh_ack_avail(sigh);
-			_block.tx_channel()->sigh_ready_to_submit(sigh);
-
 			if (verbose)
 				Genode::log("Request for file ", Cstring(_path), " len ", strlen(_path));
 
 			try {
-				return *new (_alloc) Rom_component(_env, _alloc, _cache, _block, _path);
+				/* the quota beyond the metadata pays for file content */
+				Rom_component &rom = *new (_alloc)
+					Rom_component(_file(_path), ++_requests, ram_quota - md_size);
+
+				_donated += rom.quota;
+
+				_evict();
+				_report();
+
+				return rom;
 			}
 			catch (Io_error)       { throw Service_denied(); }
 			catch (Non_data_disc)  { throw Service_denied(); }
 			catch (File_not_found) { throw Service_denied(); }
 		}
 
+		void _destroy_session(Rom_component &rom) override
+		{
+			_donated -= rom.quota;
+
+			Root_component::_destroy_session(rom);
+
+			_evict();
+			_report();
+
+			/* faults that failed for lack of memory may succeed now */
+			_cache.for_each([&] (File const &file) { file.retry(); });
+		}
+
 	public:
 
-		Root(Genode::Env &env, Allocator &alloc)
+		Root(Genode::Env &env, Allocator &alloc, Block::Connection<> &block,
+		     Node const &config)
 		:
 			Root_component(&env.ep().rpc_ep(), &alloc),
-			_env(env), _alloc(alloc)
-		{ }
+			_env(env), _alloc(alloc), _block(block),
+			_cache_limit(config.attribute_value("cache_limit",
+			             Number_of_bytes(env.pd().avail_ram().value / 2)))
+		{
+			if (config.attribute_value("report", false))
+				_reporter.construct(_env, "cache", "cache");
+		}
+};
+
+
+/*
+ * The configuration is optional, the defaults apply without
+ */
+struct Config
+{
+	Constructible<Attached_rom_dataspace> _rom { };
+
+	Config(Genode::Env &env)
+	{
+		try { _rom.construct(env, "config"); }
+		catch (...) { }
+	}
+
+	Node node() const { return _rom.constructed() ? _rom->node() : Node(); }
 };
 
 
 struct Main
 {
-	Genode::Env  &_env;
-	Genode::Heap  _heap { _env.ram(), _env.rm() };
+	Genode::Env            &_env;
+	Genode::Heap            _heap   { _env.ram(), _env.rm() };
+	Config                  _config { _env };
+
+	/* room for several packets in flight during file reads */
+	enum { TX_BUF_SIZE = 1024*1024 };
+
+	/* block session shared by the ROM and the file-system service */
+	Allocator_avl       _block_alloc { &_heap };
+	Block::Connection<> _block       { _env, &_block_alloc, TX_BUF_SIZE };
 
-	Iso::Root     _root { _env, _heap };
+	Genode::Io_signal_handler<Main> _block_handler {
+		_env.ep(), *this, &Main::_handle_block };
+
+	void _handle_block() { }
+
+	Iso::Root     _root    { _env, _heap, _block, _config.node() };
+	Iso::Fs_root  _fs_root { _env, _heap, _block };
 
 	Main(Genode::Env &env) : _env(env)
 	{
+		_block.tx_channel()->sigh_ack_avail(_block_handler);
+		_block.tx_channel()->sigh_ready_to_submit(_block_handler);
+
 		_env.parent().announce(_env.ep().manage(_root));
+		_env.parent().announce(_env.ep().manage(_fs_root));
 	}
 };
 
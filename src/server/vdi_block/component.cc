@@ -16,67 +16,136 @@
 #include <base/attached_rom_dataspace.h>
 #include <base/component.h>
 #include <base/log.h>
+#include <base/mutex.h>
+#include <os/session_policy.h>
 #include <timer_session/connection.h>
 #include <root/root.h>
 
 #include "vdi_file.h"
+#include "vdi_ring.h"
 
 namespace Vdi {
 	struct Main;
 	struct Block_session_handler;
+	struct Block_session_tx_buffer;
 	struct Block_session_component;
 	using namespace Genode;
 }
 
+/*
+ * The packet stream is handled by the front-end entrypoint, the VFS I/O is
+ * executed by the component entrypoint, which owns the VFS
+ */
 struct Vdi::Block_session_handler : Interface
 {
 	Genode::Env             &env;
+	Genode::Entrypoint      &front_ep;
+
+	/* front-end handling stops on session close */
+	Mutex front_mutex { };
+	bool  closed      { false };
 
 	Signal_handler<Block_session_handler> request_handler
-	  { env.ep(), *this, &Block_session_handler::handle};
+	  { front_ep, *this, &Block_session_handler::handle};
 
-	Block_session_handler(Env &env) : env(env) { }
+	Signal_handler<Block_session_handler> io_handler
+	  { env.ep(), *this, &Block_session_handler::handle_io };
+
+	Block_session_handler(Env &env, Entrypoint &front_ep)
+	: env(env), front_ep(front_ep) { }
 
 	~Block_session_handler() { }
 
 	virtual void handle_requests()= 0;
+	virtual bool execute_io()= 0;
 
 	void handle()
 	{
-		handle_requests();
+		Mutex::Guard guard(front_mutex);
+
+		if (!closed)
+			handle_requests();
+	}
+
+	void handle_io()
+	{
+		while (execute_io()) { }
 	}
+
+	void close()
+	{
+		Mutex::Guard guard(front_mutex);
+		closed = true;
+	}
+};
+
+struct Vdi::Block_session_tx_buffer
+{
+	Attached_ram_dataspace tx_ds;
+
+	Block_session_tx_buffer(Env &env, size_t const size)
+	: tx_ds(env.ram(), env.rm(), size) { }
 };
 
 struct Vdi::Block_session_component : Rpc_object<::Block::Session>,
                                       Block_session_handler,
+                                      private Block_session_tx_buffer,
                                       ::Block::Request_stream
 {
-	Vdi::File &vdi;
+	Vdi::File      &vdi;
+	unsigned const  id;
+
+	/* requests from the front end to the I/O side and back */
+	struct Submitted
+	{
+		::Block::Request request;
+		char           * payload;
+	};
+
+	enum { RING_SIZE = 128 };
+
+	Ring<Submitted,        RING_SIZE> submitted { };
+	Ring<::Block::Request, RING_SIZE> completed { };
 
-	Block_session_component(Env &env, Ram_dataspace_capability ram_cap,
-	                        Vdi::File &file)
+	static ::Block::Session::Info _info(Vdi::File const &file,
+	                                    ::Block::Constrained_view const &view)
+	{
+		::Block::Session::Info info = file.info();
+		info.writeable = view.writeable;
+		return info;
+	}
+
+	Block_session_component(Env &env, Entrypoint &front_ep, size_t const tx_buf_size,
+	                        Vdi::File &file, unsigned const id,
+	                        ::Block::Constrained_view const &view)
 	:
-	  Block_session_handler(env),
-	  Request_stream(env.rm(), ram_cap, env.ep(), request_handler, file.info(),
-	                 { .offset     = ::Block::Constrained_view::Offset { 0 },
-	                   .num_blocks = ::Block::Constrained_view::Num_blocks { 0 },
-	                   .writeable  = true }),
-	  vdi(file)
+	  Block_session_handler(env, front_ep),
+	  Block_session_tx_buffer(env, tx_buf_size),
+	  Request_stream(env.rm(), tx_ds.cap(), front_ep, request_handler,
+	                 _info(file, view), view),
+	  vdi(file), id(id)
 	{
-		env.ep().manage(*this);
+		front_ep.manage(*this);
 
-		vdi.set_notify_cap(request_handler);
+		vdi.open_client(id, io_handler, view.writeable);
 	}
 
 	~Block_session_component()
 	{
-		vdi.set_notify_cap(Genode::Signal_context_capability());
+		front_ep.dissolve(*this);
+
+		close();
+
+		/* finish jobs in flight, the payload buffer vanishes afterwards */
+		while (vdi.jobs_active(id)) {
+			if (!execute_io())
+				env.ep().wait_and_dispatch_one_io_signal();
+		}
 
-		bool progress = handle_request(true /* closing */);
-		if (progress)
-			wakeup_client_if_needed();
+		/* drop completed but not acknowledged jobs */
+		vdi.with_completed(id, [&] (::Block::Request const &) { return true; });
 
-		env.ep().dissolve(*this);
+		vdi.close_client(id);
 	}
 
 	Info info() const override { return Request_stream::info(); }
@@ -84,7 +153,9 @@ struct Vdi::Block_session_component : Rpc_object<::Block::Session>,
 	Capability<Tx> tx_cap() override { return Request_stream::tx_cap(); }
 
 	void handle_requests() override;
-	bool handle_request(bool closing);
+	bool handle_request();
+
+	bool execute_io() override;
 };
 
 
@@ -92,7 +163,7 @@ void Vdi::Block_session_component::handle_requests()
 {
 	while (true) {
 
-		bool const progress = handle_request(false);
+		bool const progress = handle_request();
 
 		if (progress == false) break;
 	}
@@ -102,64 +173,134 @@ void Vdi::Block_session_component::handle_requests()
 }
 
 
-bool Vdi::Block_session_component::handle_request(bool closing)
+/*
+ * Front end - pass requests to the I/O side and acknowledge completed ones
+ */
+bool Vdi::Block_session_component::handle_request()
 {
-	bool progress = false;
+	bool progress  = false;
+	bool submit    = false;
+	bool ring_free = false;
 
 	with_requests([&] (::Block::Request request) {
 
-		Response response = Response::RETRY;
+		if (submitted.full())
+			return Response::RETRY;
 
-		with_payload([&] (Request_stream::Payload const &payload) {
-			response = vdi.handle(request, payload);
+		char * payload = nullptr;
+		bool   valid   = true;
 
-			if (response == Response::ACCEPTED) {
+		if (::Block::Operation::has_payload(request.operation.type))
+			with_payload([&] (Request_stream::Payload const &p) {
+				p.with_content(request, [&] (void *addr, size_t const size) {
+					payload = reinterpret_cast<char *>(addr);
+					valid   = size >= request.operation.count * info().block_size;
+				});
+			});
 
-				progress = true;
-				request.success = true;
+		progress = true;
 
-				bool done = false;
-				try_acknowledge([&](Ack &ack) {
+		if (!valid) {
+			Genode::error("request exceeds payload, block=",
+			              request.operation.block_number,
+			              " count=", request.operation.count);
+			return Response::REJECTED;
+		}
 
-					if (done) return;
+		submitted.push({ request, payload });
+		submit = true;
 
-					ack.submit(request);
-					done = true;
-				});
+		return Response::ACCEPTED;
+	});
+
+	/* acknowledge completed jobs, possibly out of order */
+	while (!completed.empty()) {
 
-				if (!done)
-					Genode::error("ack missing ... stall ahead");
+		::Block::Request const request = completed.front();
+
+		bool done = false;
+		try_acknowledge([&](Ack &ack) {
+
+			if (done) return;
+
+			ack.submit(request);
+			done = true;
+		});
+
+		if (!done)
+			break;
+
+		completed.pop();
+		progress  = true;
+		ring_free = true;
 
 #if 0
-				Genode::log("request ", (int)request.operation.type,
-				            request.operation.type == ::Block::Operation::Type::WRITE ? " write" : "",
-				            request.operation.type == ::Block::Operation::Type::READ  ? " read" : "",
-				            " request offset=",request.offset,
-				            " block=", request.operation.block_number,
-				            " count=", request.operation.count,
-				            " done");
+		Genode::log("request ", (int)request.operation.type,
+		            request.operation.type == ::Block::Operation::Type::WRITE ? " write" : "",
+		            request.operation.type == ::Block::Operation::Type::READ  ? " read" : "",
+		            " request offset=",request.offset,
+		            " block=", request.operation.block_number,
+		            " count=", request.operation.count,
+		            request.success ? " done" : " failed");
 #endif
-			} else {
-				if (response == Response::RETRY)
-					return;
-
-				Genode::error("unknown state - request ", (int)request.operation.type,
-				              request.operation.type == ::Block::Operation::Type::WRITE ? " write" : "",
-				              request.operation.type == ::Block::Operation::Type::READ  ? " read" : "",
-				              " request offset=",request.offset,
-				              " block=", request.operation.block_number,
-				              " count=", request.operation.count);
-				Genode::Mutex mutex;
-				while (true) { mutex.acquire(); }
-			}
-		});
+	}
+
+	if (submit || ring_free)
+		Signal_transmitter(io_handler).submit();
+
+	return progress;
+}
+
+
+/*
+ * I/O side - execute requests on the VFS and hand back completed ones
+ */
+bool Vdi::Block_session_component::execute_io()
+{
+	bool progress = false;
+	bool complete = false;
+
+	/* queue requests as long as job slots are available */
+	while (!submitted.empty() && !completed.full()) {
+
+		Submitted const &s = submitted.front();
+
+		Response const response = vdi.submit(id, s.request, s.payload);
+
+		if (response == Response::RETRY)
+			break;
 
-		if (response == Response::RETRY && closing)
-			Genode::warning("session is closing but still work to do ...");
+		if (response == Response::REJECTED) {
+			Genode::error("request rejected ", (int)s.request.operation.type,
+			              " block=", s.request.operation.block_number,
+			              " count=", s.request.operation.count);
 
-		return response;
+			::Block::Request request = s.request;
+			request.success = false;
+
+			completed.push(request);
+			complete = true;
+		}
+
+		submitted.pop();
+		progress = true;
+	}
+
+	if (vdi.execute(id))
+		progress = true;
+
+	vdi.with_completed(id, [&] (::Block::Request const &request) {
+		if (!completed.push(request))
+			return false;
+
+		complete = true;
+		progress = true;
+		return true;
 	});
 
+	if (complete)
+		Signal_transmitter(request_handler).submit();
+
 	return progress;
 }
 
@@ -168,12 +309,24 @@ struct Vdi::Main : Rpc_object<Typed_root<::Block::Session>>
 {
 	Env                                   & env;
 	Attached_rom_dataspace                  config   { env, "config" };
-	Constructible<Attached_ram_dataspace>   block_ds { };
+
+	/* packet-stream handling, decoupled from the VFS I/O */
+	Entrypoint                              front_ep { env, 4 * 1024 * sizeof(long),
+	                                                   "block_front",
+	                                                   Affinity::Location() };
 	Constructible<Vdi::File>                vdi_file { };
-	Constructible<Block_session_component>  client   { };
 	Signal_handler<Main>                    notify   { env.ep(), *this,
 	                                                   &Main::init};
 
+	Constructible<Block_session_component>  clients[Vdi::File::max_clients()] { };
+
+	bool writer() const
+	{
+		for (auto const &client : clients)
+			if (client.constructed() && client->info().writeable) return true;
+		return false;
+	}
+
 	void init()
 	{
 		bool init_done = vdi_file->init(notify);
@@ -186,14 +339,11 @@ struct Vdi::Main : Rpc_object<Typed_root<::Block::Session>>
 		log("--- Starting VDI driver ---");
 
 		vdi_file.construct(env, config.node());
-		vdi_file->init(notify);
+		init();
 	}
 
 	Root::Result session(Root::Session_args const &args, Affinity const &) override
 	{
-		if (client  .constructed()) return Session_error::DENIED;
-		if (block_ds.constructed()) return Session_error::DENIED;
-
 		Session_label const label = label_from_args(args.string());
 
 		Ram_quota const ram_quota = ram_quota_from_args(args.string());
@@ -209,24 +359,56 @@ struct Vdi::Main : Rpc_object<Typed_root<::Block::Session>>
 			return Session_error::DENIED;
 		}
 
-		try {
-			block_ds.construct(env.ram(), env.rm(), tx_buf_size);
-			client.construct(env, block_ds->cap(), *vdi_file);
-			return { client->cap() };
-		} catch (...) {
-			error("rejecting session request '", label, "'");
+		/*
+		 * Sessions are writeable if granted by their policy, without
+		 * policy the first session of a writeable image is the writer
+		 */
+		::Block::Constrained_view view {
+			.offset     = ::Block::Constrained_view::Offset     { 0 },
+			.num_blocks = ::Block::Constrained_view::Num_blocks { 0 },
+			.writeable  = vdi_file->info().writeable && !writer() };
+
+		with_matching_policy(label, config.node(), [&] (Node const &policy) {
+			view = {
+				.offset     = { policy.attribute_value("offset",     0ull) },
+				.num_blocks = { policy.attribute_value("num_blocks", 0ull) },
+				.writeable  = vdi_file->info().writeable &&
+				              policy.attribute_value("writeable", false) };
+		}, [&] { });
+
+		/* a single writer at a time */
+		if (view.writeable && writer()) {
+			error("rejecting second writeable session '", label, "'");
+			return Session_error::DENIED;
+		}
+
+		for (unsigned id = 0; id < Vdi::File::max_clients(); id++) {
+			if (clients[id].constructed())
+				continue;
+
+			try {
+				clients[id].construct(env, front_ep, tx_buf_size, *vdi_file, id, view);
+				log("session '", label, "' writeable: ",
+				    view.writeable ? "yes" : "no");
+				return { clients[id]->cap() };
+			} catch (...) {
+				error("rejecting session request '", label, "'");
+				return Session_error::DENIED;
+			}
 		}
 
+		error("too many sessions, rejecting '", label, "'");
 		return Session_error::DENIED;
 	}
 
 	void upgrade(Session_capability, Root::Upgrade_args const&) override {
 		Genode::warning(__func__, " not implemented"); }
 
-	void close(Session_capability) override
+	void close(Session_capability cap) override
 	{
-		if (client  .constructed()) client  .destruct();
-		if (block_ds.constructed()) block_ds.destruct();
+		for (auto &client : clients)
+			if (client.constructed() && client->cap() == cap)
+				client.destruct();
 	}
 };
 
@@ -0,0 +1,246 @@
+/*
+ * \brief  Write-back cache of the virtual disk content
+ * \author Alexander Boettcher
+ * \date   2026-10-16
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#pragma once
+
+/* Genode includes */
+#include <base/attached_ram_dataspace.h>
+
+namespace Vdi { class Cache; }
+
+
+/*
+ * Pages of the virtual disk with per-sector valid and dirty bits, the least
+ * recently used page without dirty sectors is replaced
+ */
+class Vdi::Cache
+{
+	public:
+
+		enum { PAGE_SIZE = 4096 };
+
+		struct Page
+		{
+			uint64_t index;     /* page of the virtual disk */
+			uint64_t used;      /* LRU stamp */
+			uint64_t valid;     /* sector masks */
+			uint64_t dirty;
+			uint64_t writing;   /* sectors currently written back */
+			uint64_t rewritten; /* sectors modified during write back */
+			uint64_t modified;  /* generation of the last modification */
+			uint32_t next;      /* hash chain, slot + 1 or 0 */
+			bool     present;
+		};
+
+		struct Stats
+		{
+			uint64_t hits;
+			uint64_t misses;
+			uint64_t writebacks;
+		};
+
+		Stats stats { 0, 0, 0 };
+
+	private:
+
+		Cache(Cache const &) = delete;
+		Cache &operator = (Cache const &) = delete;
+
+		Genode::size_t const _sector_size;
+		Genode::size_t const _page_size;
+		unsigned       const _sectors;
+		unsigned       const _count;
+		unsigned       const _buckets;
+
+		/* page content, page descriptors and hash buckets */
+		Genode::Attached_ram_dataspace _ds;
+
+		char     * const _content;
+		Page     * const _pages;
+		uint32_t * const _bucket;
+
+		uint64_t _clock { 0 };
+
+		/*
+		 * Modifications are counted, 'dropped' is the latest modification
+		 * of a page evicted or released
+		 */
+		uint64_t _generation { 0 };
+		uint64_t _dropped    { 0 };
+
+		static unsigned _bucket_count(unsigned const count)
+		{
+			unsigned buckets = 1;
+			while (buckets < count) buckets <<= 1;
+			return buckets;
+		}
+
+		unsigned _slot(Page const &page) const { return unsigned(&page - _pages); }
+
+		uint32_t &_head(uint64_t const index) { return _bucket[index & (_buckets - 1)]; }
+
+		void _unlink(Page &page)
+		{
+			for (uint32_t *link = &_head(page.index); *link; link = &_pages[*link - 1].next) {
+				if (*link != _slot(page) + 1)
+					continue;
+
+				*link = page.next;
+				break;
+			}
+
+			_dropped     = Genode::max(_dropped, page.modified);
+			page.present = false;
+		}
+
+	public:
+
+		Cache(Genode::Ram_allocator &ram, Genode::Region_map &rm,
+		      Genode::size_t const budget, Genode::size_t const sector_size)
+		:
+			_sector_size(sector_size),
+			_page_size(Genode::max(Genode::size_t(PAGE_SIZE), sector_size)),
+			_sectors(unsigned(_page_size / _sector_size)),
+			_count(unsigned(Genode::max(budget / _page_size, Genode::size_t(1)))),
+			_buckets(_bucket_count(_count)),
+			_ds(ram, rm, _count * (_page_size + sizeof(Page)) + _buckets * sizeof(uint32_t)),
+			_content(_ds.local_addr<char>()),
+			_pages((Page *)(_content + _count * _page_size)),
+			_bucket((uint32_t *)(_pages + _count))
+		{
+			for (unsigned i = 0; i < _count; i++)
+				_pages[i] = { 0, 0, 0, 0, 0, 0, 0, 0, false };
+
+			for (unsigned i = 0; i < _buckets; i++)
+				_bucket[i] = 0;
+		}
+
+		unsigned pages()   const { return _count; }
+		unsigned sectors() const { return _sectors; }
+
+		Genode::size_t sector_size() const { return _sector_size; }
+
+		static uint64_t mask(unsigned const first, unsigned const count)
+		{
+			return (count >= 64 ? ~0ull : ((1ull << count) - 1)) << first;
+		}
+
+		char *content(Page const &page) { return _content + _slot(page) * _page_size; }
+
+		Page *lookup(uint64_t const index)
+		{
+			for (uint32_t s = _head(index); s; s = _pages[s - 1].next) {
+				Page &page = _pages[s - 1];
+
+				if (page.index != index)
+					continue;
+
+				page.used = ++_clock;
+				return &page;
+			}
+			return nullptr;
+		}
+
+		/*
+		 * Page for 'index', a page with dirty sectors is never replaced
+		 *
+		 * \return nullptr if all pages are dirty
+		 */
+		Page *alloc(uint64_t const index)
+		{
+			Page *victim = nullptr;
+
+			for (unsigned i = 0; i < _count; i++) {
+				Page &page = _pages[i];
+
+				if (page.dirty || page.writing)
+					continue;
+
+				if (!victim || (victim->present && (!page.present || page.used < victim->used)))
+					victim = &page;
+			}
+
+			if (!victim)
+				return nullptr;
+
+			if (victim->present)
+				_unlink(*victim);
+
+			*victim = { index, ++_clock, 0, 0, 0, 0, 0, _head(index), true };
+
+			_head(index) = _slot(*victim) + 1;
+
+			return victim;
+		}
+
+		uint64_t generation() const { return _generation; }
+
+		void modified(Page &page) { page.modified = ++_generation; }
+
+		/* sectors got dropped regardless of being cached */
+		void discarded() { _dropped = ++_generation; }
+
+		/* content read at 'generation' may be outdated by a dropped page */
+		bool dropped_since(uint64_t const generation) const {
+			return _dropped > generation; }
+
+		void release(Page &page)
+		{
+			if (page.present)
+				_unlink(page);
+		}
+
+		/* least recently used page with dirty sectors not under write back */
+		Page *oldest_dirty()
+		{
+			Page *oldest = nullptr;
+
+			for (unsigned i = 0; i < _count; i++) {
+				Page &page = _pages[i];
+
+				if (!page.present || !page.dirty || page.writing)
+					continue;
+
+				if (!oldest || page.used < oldest->used)
+					oldest = &page;
+			}
+			return oldest;
+		}
+
+		unsigned dirty_pages() const
+		{
+			unsigned dirty = 0;
+			for (unsigned i = 0; i < _count; i++)
+				if (_pages[i].present && _pages[i].dirty) dirty++;
+			return dirty;
+		}
+
+		/*
+		 * Split sector range into parts per page, 'fn' gets the page index,
+		 * first sector and sector count within the page and the byte
+		 * offset relative to 'nr'
+		 */
+		template <typename FN>
+		void for_each_part(uint64_t const nr, uint64_t const count, FN const &fn) const
+		{
+			for (uint64_t s = nr; s < nr + count; ) {
+				unsigned const first = unsigned(s % _sectors);
+				unsigned const num   = unsigned(Genode::min(uint64_t(_sectors - first),
+				                                            nr + count - s));
+
+				fn(s / _sectors, first, num, (s - nr) * _sector_size);
+
+				s += num;
+			}
+		}
+};
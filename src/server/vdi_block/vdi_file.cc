@@ -14,452 +14,1610 @@
 /* local includes */
 #include "vdi_file.h"
 
-Vdi::File::Response
-Vdi::File::_read_split(::Block::Operation const operation,
-                       void * dst, Genode::Vfs::file_size const dst_size,
-                       uint64_t const file_offset,
-                       uint32_t const max_offset_read)
-{
-	if (_state_fs_read.state == Read::NONE) {
-		_state_fs_read.bytes_read = 0;
-		_state_fs_read.offset     = file_offset;
-		if (max_offset_read < dst_size) {
-			_state_fs_read.remaining = max_offset_read;
-			_state_fs_read.operation = operation;
-		} else {
-			_state_fs_read.remaining = dst_size;
-			_state_fs_read.operation.type = ::Block::Operation::Type::INVALID;
-		}
+bool Vdi::File::_init_image()
+{
+	Preheader    const &ph = *(Preheader*)(_header_addr);
+	HeaderV1Plus const  &h = *(HeaderV1Plus*)(_header_addr + sizeof(Preheader));
+
+	print_headers(ph, h);
 
-		_state_fs_read.state = Read::READ;
+	if (!ph.valid()) {
+		Genode::error("signature error");
+		return false;
 	}
 
-	auto const read_before = _state_fs_read.bytes_read;
+	if (h.blocks_offset < sizeof(Preheader) + sizeof(HeaderV1Plus) ||
+	    h.data_offset < h.blocks_offset + uint64_t(h.blocks) * sizeof(Vdi::Block::value)) {
+		Genode::error("block table location error");
+		return false;
+	}
+
+	if (h.type == HeaderV1Plus::TYPE_DIFF && !_parent_count) {
+		Genode::error("differencing image requires <parent> configuration");
+		return false;
+	}
 
-	do {
-		_read(reinterpret_cast<char *>(dst), _state_fs_read.remaining);
-	} while (_state_fs_read.state == Read::LOOP_READ);
+	if (h.type != HeaderV1Plus::TYPE_DIFF && _parent_count) {
+		Genode::warning("not a differencing image, <parent> ignored");
+		_parent_count = 0;
+	}
+
+	uint32_t const sector_size = h.legacy_geometry.sector_size
+	                           ? h.legacy_geometry.sector_size
+	                           : uint32_t(Disk_geometry::SECTOR_SIZE);
+
+	if (sector_size < Disk_geometry::SECTOR_SIZE || (sector_size & (sector_size - 1)) ||
+	    h.block_size < sector_size || (h.block_size % sector_size)) {
+		Genode::error("unsupported block size ", h.block_size,
+		              " or sector size ", sector_size);
+		return false;
+	}
+
+	_md.construct(h.blocks_offset, h.data_offset,
+	              h.block_size, h.block_size_extra, sector_size);
+	_md->max_blocks       = h.blocks;
+	_md->allocated_blocks = h.allocated_blocks;
+
+	_table.construct(_env.ram(), _env.rm(), h.blocks, _table_budget);
+	_md->table = &*_table;
+
+	if (_cache_budget) {
+		_cache.construct(_env.ram(), _env.rm(), _cache_budget, sector_size);
+		Genode::log("cache: ", _cache->pages(), " pages");
+	}
 
-	if (_state_fs_read.state != Read::NONE)
-		return Response::RETRY;
+	if (_overlay_ram) {
+		_overlay.construct(_env.ram(), _env.rm(), _heap, _overlay_limit,
+		                   h.block_size, sector_size);
+		Genode::log("overlay: ", _overlay->blocks(), " blocks");
+	}
 
-	/* sanity check, READ::NONE should be same as remaining == 0 - XXX remove me */
-	if (_state_fs_read.remaining) {
-		Genode::error("invalid read state - unexpected remaining state");
-		return Response::REJECTED;
+	_block_ops.block_size = sector_size;
+	_block_ops.block_count = h.disk_size / _block_ops.block_size;
+
+	Genode::log("block_size: ", uint64_t(_block_ops.block_size),
+	            " block_count: ", uint64_t(_block_ops.block_count),
+	            " vdi block size: ", h.block_size,
+	            " table cache: ", _table->pages(), " pages");
+
+	/*
+	 * Fixed images are created with linear block mapping, which is
+	 * verified per table page on first use
+	 */
+	if (h.type == HeaderV1Plus::TYPE_FIXED) {
+		_fixed = h.allocated_blocks == h.blocks && !h.block_size_extra;
+
+		if (_fixed)
+			Genode::log("fixed image, linear block mapping");
+		else
+			Genode::warning("fixed image without linear block mapping");
 	}
 
-	if (_state_fs_read.operation.type == ::Block::Operation::Type::INVALID) {
-		_state_fs_read.dst_offset = 0;
-		return Response::ACCEPTED;
+	if (!_parent_count)
+		return true;
+
+	_chain.image = new (_heap) uint8_t [h.blocks];
+	_chain.block = new (_heap) uint32_t[h.blocks];
+
+	for (uint32_t i = 0; i < h.blocks; i++)
+		_chain.image[i] = CHAIN_UNRESOLVED;
+
+	_parent_uuid = h.prev_uuid;
+
+	_parent_header.construct(_env.ram(), _env.rm(), _header_buffer.size());
+	_parent_table .construct(_env.ram(), _env.rm(),
+	                         Genode::max(Genode::size_t(h.blocks) * sizeof(Vdi::Block),
+	                                     Genode::size_t(1)));
+	_copy_buffer  .construct(_env.ram(), _env.rm(), _zero_size);
+
+	_init_io.read(0, _parent_header->size());
+
+	return true;
+}
+
+/*
+ * Read header and block table of all parents and build the flattened block
+ * lookup
+ */
+bool Vdi::File::_init_parent()
+{
+	while (_parent_init < _parent_count) {
+
+		Parent &parent = _parents[_parent_init];
+		char * const buffer = _parent_header->local_addr<char>();
+		char * const table  = _parent_table ->local_addr<char>();
+
+		auto const result = _read(*parent.handle, _init_io,
+		                          _parent_table_read ? table : buffer);
+
+		if (result == Vdi::Io::PENDING)
+			return false;
+
+		Preheader    const &ph = *(Preheader*)(buffer);
+		HeaderV1Plus const  &h = *(HeaderV1Plus*)(buffer + sizeof(Preheader));
+
+		bool const last = _parent_init + 1 == _parent_count;
+
+		auto const failed = [&] (auto const &msg) {
+			Genode::error("parent '", parent.file, "' ", msg);
+			_init = Init::FAILED;
+			return false;
+		};
+
+		if (result == Vdi::Io::ERROR)
+			return failed(_parent_table_read ? "read block table failed"
+			                                 : "read header failed");
+
+		if (!_parent_table_read) {
+
+			if (_init_io.done < sizeof(Preheader) + sizeof(HeaderV1Plus) || !ph.valid())
+				return failed("header invalid");
+
+			if (!(h.image_uuid == _parent_uuid))
+				return failed("UUID does not match the image it is parent of");
+
+			if (h.blocks != _md->max_blocks || h.block_size != _md->block_size ||
+			    h.block_size_extra != _md->block_extra)
+				return failed("geometry differs");
+
+			if (last == (h.type == HeaderV1Plus::TYPE_DIFF))
+				return failed(last ? "is differencing image, chain incomplete"
+				                   : "is no differencing image");
+
+			_parent_table_read = true;
+			_init_io.read(h.blocks_offset, h.blocks * sizeof(Vdi::Block));
+			continue;
+		}
+
+		if (result == Vdi::Io::END)
+			return failed("block count error");
+
+		Vdi::Block const * const entries = (Vdi::Block const *)table;
+
+		for (uint32_t bid = 0; bid < h.blocks; bid++) {
+			if (_chain.image[bid] != CHAIN_UNRESOLVED)
+				continue;
+
+			if (entries[bid].allocated()) {
+				_chain.image[bid] = uint8_t(_parent_init + 1);
+				_chain.block[bid] = entries[bid].value;
+			} else
+			if (entries[bid].zero())
+				_chain.image[bid] = CHAIN_ZERO;
+		}
+
+		parent.data_offset = h.data_offset;
+
+		_parent_uuid = h.prev_uuid;
+		_parent_init ++;
+
+		_parent_table_read = false;
+
+		if (!last)
+			_init_io.read(0, _parent_header->size());
 	}
 
-	if (read_before > _state_fs_read.bytes_read) {
-		Genode::error("invalid read state");
-		return Response::REJECTED;
+	/* blocks not allocated in the whole chain read as zeros */
+	for (uint32_t bid = 0; bid < _md->max_blocks; bid++)
+		if (_chain.image[bid] == CHAIN_UNRESOLVED)
+			_chain.image[bid] = CHAIN_ZERO;
+
+	_parent_header.destruct();
+	_parent_table .destruct();
+
+	Genode::log("differencing image with ", _parent_count, " parent image",
+	            _parent_count > 1 ? "s" : "");
+
+	return true;
+}
+
+/*
+ * Returns true if the table entry of 'bid' is present, otherwise the
+ * loading of its page is started
+ */
+bool Vdi::File::_present(uint64_t const bid)
+{
+	if (_table->present(bid))
+		return true;
+
+	/* one page is loaded at a time */
+	if (_page_in)
+		return false;
+
+	/* keep the page of an ongoing allocation and of the write back */
+	_page_in = _table->replace(bid, [&] (Vdi::Table_cache::Page const &page) {
+		return &page == _flush.page ||
+		       (_alloc.job && page.index ==
+		        Vdi::Table_cache::page_of(sector_to_block(_alloc.block_nr))); });
+
+	if (!_page_in) {
+		/* all pages are dirty, write back to make them replaceable */
+		if (_start_flush(nullptr))
+			Genode::Signal_transmitter(_flush_handler).submit();
+		return false;
 	}
 
-	auto const blocks = _state_fs_read.bytes_read / _block_ops.block_size;
-	if (_state_fs_read.bytes_read % _block_ops.block_size) {
-		Genode::error("invalid read state - bytes read");
-		return Response::REJECTED;
+	_page_io.read(_md->blocks_offset + Vdi::Table_cache::offset(*_page_in),
+	              _table->size(*_page_in));
+
+	_execute_page_in();
+
+	return _table->present(bid);
+}
+
+/*
+ * Returns true if loading of a table page finished
+ */
+bool Vdi::File::_execute_page_in()
+{
+	if (!_page_in)
+		return false;
+
+	auto const result = _read(*_table_file, _page_io, _table->content(*_page_in));
+
+	if (result == Vdi::Io::PENDING)
+		return false;
+
+	if (result != Vdi::Io::DONE) {
+		Genode::error("reading block table failed - out of service");
+		_fault = true;
+		return true;
 	}
 
-	if (_state_fs_read.operation.count < blocks) {
-		Genode::error("count of blocks is too small ",
-		              _state_fs_read.operation.count, " vs ", blocks,
-		              " read_before=", read_before);
-		return Response::REJECTED;
+	_table->loaded(*_page_in);
+
+	if (_fixed && !_linear(*_page_in)) {
+		Genode::warning("fixed image without linear block mapping, using block table");
+		_fixed = false;
 	}
 
-	_state_fs_read.operation.block_number += blocks;
-	_state_fs_read.operation.count        -= ::Block::block_count_t(blocks); /* size checked above */
-	_state_fs_read.dst_offset             += blocks * _block_ops.block_size;
+	_page_in = nullptr;
 
-	return Response::ACCEPTED;
+	return true;
 }
 
 void Vdi::File::_execute_alloc_block()
 {
-	uint64_t const bid = sector_to_block(_state_fs.block_nr);
+	Vdi::Job &job = *_alloc.job;
+
+	uint64_t const bid = sector_to_block(_alloc.block_nr);
 
-	if (_state_fs.state == ALLOC_BLOCK) {
-		auto const written_state_on_enter = _state_fs.written;
+	if (_alloc.state == Alloc::DATA) {
 
 		bool const allocated = _md->alloc_block(bid, [&](uint64_t const offset) {
-			do {
-				Genode::size_t written = 0;
-
-				_vdi_file->seek(offset + _state_fs.written);
-
-				auto const range = Genode::Const_byte_range_ptr(_zero_addr,
-				                                                Genode::min(_md->block_size - _state_fs.written, _zero_size));
-				Write_result res = _vdi_file->fs().write(_vdi_file, range,
-				                                         written);
-				if (res == Genode::Vfs::File_io_service::WRITE_ERR_WOULD_BLOCK) {
-					if (written != 0)
-						Genode::warning("WOULD_ERR_WOULD_BLOCK but written is not 0 -> ", written);
+			while (_alloc.written < _md->block_size) {
+
+				bool const data = _alloc.written >= _alloc.data_start &&
+				                  _alloc.written <  _alloc.data_end;
+				bool const copy = !data && _alloc.parent;
+
+				if (job.io.idle()) {
+					Genode::Vfs::file_size const end = data ? _alloc.data_end
+					                                 : (_alloc.written < _alloc.data_start)
+					                                 ? _alloc.data_start : _md->block_size;
+
+					/* the hole already reads as zeros */
+					if (!data && !copy && _alloc.hole) {
+						_alloc.written = end;
+						continue;
+					}
+
+					Genode::Vfs::file_size const size = end - _alloc.written;
+					Genode::Vfs::file_size const max  = data ? size : Genode::min(size, _zero_size);
+
+					/* uncovered parts of a differencing image come from the parent */
+					if (copy && !_alloc.copied)
+						job.io.read(_alloc.parent_offset + _alloc.written, max);
+					else
+						job.io.write(offset + _alloc.written, max);
+				}
+
+				if (copy && !_alloc.copied) {
+					auto const result = _read(job.image(_alloc.parent), job.io,
+					                          _copy_buffer->local_addr<char>());
+
+					if (result == Vdi::Io::PENDING)
+						return false;
+
+					if (result != Vdi::Io::DONE) {
+						Genode::error(__func__, " reading parent failed");
+						_alloc.state = Alloc::ERROR;
+						return false;
+					}
+
+					_alloc.copied = true;
+					continue;
+				}
+
+				char const * const src = data ? _alloc.data + (_alloc.written - _alloc.data_start)
+				                       : copy ? _copy_buffer->local_addr<char>()
+				                       : _zero_addr;
+
+				auto const result = _write(*job.handle, job.io, src);
+
+				if (result == Vdi::Io::PENDING)
 					/* will be resumed later, keep state */
 					return false;
-				}
 
-				if (res != Genode::Vfs::File_io_service::WRITE_OK) {
-					_state_fs.state = Write::ALLOC_BLOCK_ERROR;
-					Genode::error(__func__, " state: ", written, " ",
-					              _zero_size, " ", (int)res);
+				if (result != Vdi::Io::DONE) {
+					Genode::error(__func__, " state: ", _alloc.written, " ",
+					              _zero_size, " ", (int)result);
+					_alloc.state = Alloc::ERROR;
 					return false;
 				}
 
-				_state_fs.written += written;
-			} while (_state_fs.written < _md->block_size);
+				_alloc.written += job.io.size;
+				_alloc.copied   = false;
+			}
+
+			_file_size = Genode::max(_file_size, offset + _md->block_size);
 
 			return true;
 		}, [&]() {
 			Genode::error(__func__, " new block allocation failed");
-			_state_fs.state = Write::ALLOC_BLOCK_ERROR;
+			_alloc.state = Alloc::ERROR;
 		});
 
-		if (_state_fs.written != written_state_on_enter) {
-			/* trigger queued write operations to be processed */
-			_vfs_env.io().commit();
-		}
-
 		if (!allocated)
 			return;
 
-		_state_fs.state = Write::SYNC_HEADER;
+		/* table and header are written back on the next flush */
+		HeaderV1Plus &h = *(HeaderV1Plus*)(_header_addr + sizeof(Preheader));
+		h.allocated_blocks = _md->allocated_blocks;
+
+		_header_dirty = true;
+		_mark_dirty();
+
+		_alloc.state = Alloc::DONE;
+	}
+}
+
+/*
+ * Write back dirty metadata - the data of allocated blocks is synced before
+ * the block table referencing it, the final sync makes the table durable
+ */
+void Vdi::File::_execute_flush()
+{
+	if (_flush.state == Flush::DATA) {
+		if (_flush_io.idle())
+			_flush_io.sync();
+
+		auto const result = _sync(*_vdi_file, _flush_io);
+		if (result == Vdi::Io::PENDING)
+			return;
+
+		if (result != Vdi::Io::DONE) {
+			_flush.state = Flush::ERROR;
+			return;
+		}
+
+		_flush.state = Flush::META;
 	}
 
-	if (_state_fs.state == Write::SYNC_HEADER   ||
-	    _state_fs.state == Write::SYNC_HEADER_1 ||
-	    _state_fs.state == Write::SYNC_HEADER_2)
-	{
-		_sync_header(bid);
+	while (_flush.state == Flush::META) {
+
+		if (_flush_io.idle()) {
+
+			Vdi::Table_cache::Page * const page = _table->first_dirty();
+
+			if (_header_dirty) {
+				_header_dirty = false;
+				_flush_io.write(0, sizeof(Preheader) + sizeof(HeaderV1Plus));
+			} else
+			if (page) {
+				/* page stays pinned until written */
+				page->dirty = false;
+				_flush.page = page;
+				_flush_io.write(_md->blocks_offset + Vdi::Table_cache::offset(*page),
+				                _table->size(*page));
+			} else {
+				_flush.state = Flush::SYNC;
+				break;
+			}
+		}
+
+		char const * const src = _flush.page ? _table->content(*_flush.page)
+		                                     : _header_addr;
 
-		if (_state_fs.state != Write::SYNC_OK)
+		auto const result = _write(*_vdi_file, _flush_io, src);
+		if (result == Vdi::Io::PENDING)
 			/* will be resumed later, keep state */
 			return;
 
-		_state_fs.state = Write::ALLOC_BLOCK_SYNC;
+		_flush.page = nullptr;
+
+		if (result != Vdi::Io::DONE) {
+			_flush.state = Flush::ERROR;
+			return;
+		}
 	}
 
-	if (_state_fs.state == Write::ALLOC_BLOCK_SYNC) {
-		if (!_vdi_file->fs().queue_sync(_vdi_file))
+	if (_flush.state == Flush::SYNC) {
+		if (_flush_io.idle())
+			_flush_io.sync();
+
+		auto const result = _sync(*_vdi_file, _flush_io);
+		if (result == Vdi::Io::PENDING)
 			return;
-		_state_fs.state = Write::ALLOC_BLOCK_SYNC_QUEUED;
 
-		/* trigger queued sync to be processed */
-		_vfs_env.io().commit();
+		_flush.state = (result == Vdi::Io::DONE) ? Flush::DONE : Flush::ERROR;
 	}
+}
+
+bool Vdi::File::_start_flush(Vdi::Job * const job)
+{
+	if (_flush.state != Flush::IDLE)
+		return false;
+
+	/*
+	 * An allocation updates the table after syncing the data of the new
+	 * block, which must not happen during the META pass of a flush
+	 */
+	if (_alloc.job)
+		return false;
+
+	/* without dirty metadata a plain sync is sufficient */
+	_flush.state   = _dirty_any() ? Flush::DATA : Flush::SYNC;
+	_flush.job     = job;
+	_flush.page    = nullptr;
+	_flush.started = _now();
+
+	/* a flush by the timer does not cover data still in the cache */
+	_flush.seq     = (job || _cache_clean()) ? _write_seq : _synced_seq;
+
+	/* zero entries of blocks released so far are written by the flush */
+	_flush.released = _md->pending_count;
 
-	if (_state_fs.state == Write::ALLOC_BLOCK_SYNC_QUEUED) {
-		Sync_result res = _complete_sync_fs();
-		switch (res) {
-		case Genode::Vfs::File_io_service::SYNC_QUEUED:
-			_state_fs.state = Write::ALLOC_BLOCK_SYNC_QUEUED;
+	return true;
+}
+
+void Vdi::File::_handle_flush()
+{
+	_flush_armed = false;
+
+	if (_init != Init::DONE || _fault)
+		return;
+
+	/* timer triggered, write back if nobody else does */
+	if (_flush.state == Flush::IDLE) {
+		if (!_dirty_any())
 			return;
-		case Genode::Vfs::File_io_service::SYNC_ERR_INVALID:
-			_state_fs.state = Write::ERROR;
+
+		/* retry after the allocation in progress */
+		if (!_start_flush(nullptr)) {
+			_mark_dirty();
 			return;
-		case Genode::Vfs::File_io_service::SYNC_OK:
-			_state_fs.state = Write::IDLE;
 		}
 	}
+
+	if (_flush.job)
+		return;
+
+	_execute_flush();
+
+	if (_flush.state == Flush::ERROR) {
+		Genode::error("metadata flush failed - out of service");
+		_fault = true;
+	}
+
+	if (_flush.state == Flush::DONE || _flush.state == Flush::ERROR) {
+		if (_stats_timer.constructed())
+			_stats.flush.add(_now() - _flush.started);
+
+		if (_flush.state == Flush::DONE) {
+			_synced_seq = Genode::max(_synced_seq, _flush.seq);
+			_md->persisted(_flush.released);
+		}
+
+		_flush.state = Flush::IDLE;
+
+		/* allocations may wait for the flush */
+		_notify();
+	}
 }
 
-bool Vdi::File::_cross_vdi_block(::Block::Operation const operation) const
+/*
+ * Returns true if the block got allocated by the job, which includes
+ * the write of 'data' of 'length' bytes at sector 'nr'
+ */
+bool Vdi::File::_allocate_block(Vdi::Job &job, uint64_t const nr,
+                                char const * const data,
+                                Genode::Vfs::file_size const length,
+                                unsigned const parent,
+                                Genode::Vfs::file_offset const parent_offset,
+                                bool &progress)
 {
-#if 0
-	Genode::String<16> const op_string((operation.type == ::Block::Operation::Type::READ) ? "read" :
-	                                   (operation.type == ::Block::Operation::Type::WRITE) ? "write" :
-	                                   (operation.type == ::Block::Operation::Type::SYNC) ? "sync" :
-	                                   (operation.type == ::Block::Operation::Type::TRIM) ? "trim" :
-	                                   (operation.type == ::Block::Operation::Type::INVALID) ? "invalid" : "unknown");
-#endif
+	/* another job allocates currently, wait until it is done */
+	if (_alloc.job && _alloc.job != &job)
+		return false;
+
+	/* metadata write back in progress, wait to keep data ahead of table */
+	if (!_alloc.job && _flush.state != Flush::IDLE)
+		return false;
+
+	if (!_alloc.job) {
+		_reuse_released();
+
+		/* released blocks become reusable after the next flush */
+		if (_md->exhausted() && _md->pending_count) {
+			if (_md->pending_durable < _md->pending_count && _start_flush(nullptr))
+				Genode::Signal_transmitter(_flush_handler).submit();
+			return false;
+		}
 
-	uint64_t const range_size  = HeaderV1Plus::BLOCK_SIZE;
-	uint64_t const range_start = operation.block_number * _block_ops.block_size;
-	uint64_t const range_end   = (operation.block_number + operation.count) * _block_ops.block_size;
+		if (_md->exhausted()) {
+			Genode::error("allocated blocks > max blocks");
+			job.finish(false);
+			progress = true;
+			return false;
+		}
+
+		Genode::Vfs::file_offset const offset = _md->next_block_offset();
 
-#if 0
-	if ((operation.type != ::Block::Operation::Type::READ) &&
-	    (operation.type != ::Block::Operation::Type::WRITE))
-		Genode::log(op_string," ", operation.block_number, "+", operation.count);
-#endif
+		_alloc.started    = _now();
+		_alloc.state      = Alloc::DATA;
+		_alloc.job        = &job;
+		_alloc.block_nr   = nr;
+		_alloc.written    = 0;
+		_alloc.data_start = (nr % sectors_per_block()) * _md->sector_size;
+		_alloc.data_end   = _alloc.data_start + length;
+		_alloc.hole       = _extend_sparse(*job.handle, offset, _md->block_size);
+		_alloc.parent     = parent;
+		_alloc.copied     = false;
 
-	bool cross_vdi_block = (range_start / range_size) != ((range_end - 1) / range_size);
+		_alloc.parent_offset = parent_offset;
 
-#if 0
-	if (cross_vdi_block && operation.type == ::Block::Operation::Type::READ) {
-		Genode::log(op_string," ", operation.block_number, "+", operation.count,
-		            " crossing 1MB range ", Genode::Hex(range_start), "-", Genode::Hex(range_end),
-		            (_state_fs_read.state == Read::NONE) ? " none" :
-		            (_state_fs_read.state == Read::CHECK) ? " check" :
-		            (_state_fs_read.state == Read::READ) ? " read" : " unknown");
+		progress = true;
 	}
-	if (cross_vdi_block && operation.type == ::Block::Operation::Type::WRITE) {
-		Genode::log(op_string," ", operation.block_number, "+", operation.count,
-		            " crossing 1MB range ", Genode::Hex(range_start), "-", Genode::Hex(range_end),
-		            (_state_fs.state == Write::ERROR) ? " error" :
-		            (_state_fs.state == Write::IDLE) ? " idle" :
-		            (_state_fs.state == Write::ALLOC_BLOCK) ? " alloc_block" :
-		            (_state_fs.state == Write::ALLOC_BLOCK_ERROR) ? " alloc_block_error" :
-		            (_state_fs.state == Write::ALLOC_BLOCK_SYNC) ? " alloc_block_sync" :
-		            (_state_fs.state == Write::ALLOC_BLOCK_SYNC_QUEUED) ? " alloc_block_sync_queued" :
-		            (_state_fs.state == Write::SYNC_HEADER) ? " sync_header" :
-		            (_state_fs.state == Write::SYNC_HEADER_1) ? " sync_header_1" :
-		            (_state_fs.state == Write::SYNC_HEADER_2) ? " sync_header_2" :
-		            (_state_fs.state == Write::SYNC_OK) ? " sync_ok" :
-		            (_state_fs.state == Write::WRITE) ? " write" : " unknown");
+
+	/* payload buffer is stable, but only valid during with_content */
+	_alloc.data = data;
+
+	_execute_alloc_block();
+
+	if (_alloc.state == Alloc::ERROR) {
+		Genode::error("block allocation failed - out of service");
+		_fault     = true;
+		_alloc.job = nullptr;
+
+		job.finish(false);
+		progress = true;
+		return false;
 	}
-#endif
 
-	return cross_vdi_block;
+	if (_alloc.state != Alloc::DONE)
+		return false;
+
+	if (_stats_timer.constructed())
+		_stats.alloc.add(_now() - _alloc.started);
+
+	_alloc.state = Alloc::IDLE;
+	_alloc.job   = nullptr;
+
+	/* flushes may wait for the allocation */
+	_notify();
+
+	progress = true;
+	return true;
 }
 
-Vdi::File::Response
-Vdi::File::_vdi_read(::Block::Request const & request,
-                     ::Block::Request_stream::Payload const &payload)
+bool Vdi::File::_execute_rw(Vdi::Job &job, char * const buffer)
 {
-	Response response {Response::REJECTED};
+	bool progress = false;
+	bool const write = job.type(::Block::Operation::Type::WRITE);
 
-	payload.with_content(request, [&] (void *addr, Genode::Vfs::file_size const dst_size) {
-		char * dst = reinterpret_cast<char *>(addr);
-		Genode::Vfs::file_size dst_offset = 0;
+	Genode::Vfs::file_size const total = job.request.operation.count *
+	                                     _block_ops.block_size;
 
-		::Block::Operation operation = request.operation;
+	while (job.state == Vdi::Job::IN_PROGRESS) {
 
-		bool loop = false;
+		/* an allocation uses the job I/O to write the new block */
+		if (job.io.idle() || _alloc.job == &job) {
 
-		do {
+			if (job.done >= total) {
+				job.finish(true);
+				progress = true;
+				break;
+			}
 
-			if (_state_fs_read.dst_offset)
-			{
-				operation  = _state_fs_read.operation;
-				dst_offset = _state_fs_read.dst_offset;
+			/* determine next segment, which never crosses a VDI block */
+			uint64_t const nr = job.request.operation.block_number +
+			                    job.done / _block_ops.block_size;
+			Genode::Vfs::file_size const remaining = total - job.done;
 
-#if 0
-				Genode::log("read ", request.operation.block_number, "+", request.operation.count,
-				            " -> ", operation.block_number, "+", operation.count,
-				            " - dst_offset=", dst_offset);
-#endif
+			/* wait for the table page of the block */
+			if (!_present(sector_to_block(nr))) {
+				if (_fault) {
+					job.finish(false);
+					progress = true;
+				}
+				break;
 			}
 
-#if 0
-			/* debug */
-			_cross_vdi_block(operation);
-#endif
+			/* a new block contains the segment written on allocation */
+			auto const allocate = [&] (Genode::Vfs::file_size const length,
+			                           unsigned const parent,
+			                           Genode::Vfs::file_offset const parent_offset) {
+				if (!_allocate_block(job, nr, buffer + job.done, length,
+				                     parent, parent_offset, progress))
+					return false;
 
-			Genode::Vfs::file_size const len = operation.count * _block_ops.block_size;
+				job.done += length;
+				return true;
+			};
 
-			loop = _apply_block(operation.block_number, [&](Genode::uint32_t const max_offset_read) {
-				if (dst_size - dst_offset != len) {
-					Genode::warning("read ", dst_size, "-", dst_offset, "=", dst_size - dst_offset, " !=", len);
+			/* zeros need no allocation, the block reads as zeros already */
+			auto const skip_zeros = [&] (Genode::Vfs::file_size const length) {
+				if (!Vdi::zero_data(buffer + job.done, length))
 					return false;
-				}
 
-				if (dst_size < dst_offset) {
-					Genode::error("read dst_size < dst_offset - ", dst_size, "<", dst_offset);
-					return false;
+				job.done += length;
+				progress  = true;
+				return true;
+			};
+
+			bool const next = _apply_block(nr, [&](uint32_t const max) {
+				Genode::Vfs::file_size const length = Genode::min(remaining,
+				                                                  Genode::Vfs::file_size(max));
+				if (write)
+					return skip_zeros(length) || allocate(length, 0, 0);
+
+				/* not allocated blocks read as zeros */
+				__builtin_memset(buffer + job.done, 0, Genode::size_t(length));
+				job.done += length;
+				progress  = true;
+				return true;
+			}, [&](unsigned const image, uint64_t const offset, uint32_t const max) {
+				Genode::Vfs::file_size length = Genode::min(remaining,
+				                                            Genode::Vfs::file_size(max));
+
+				/* a block overwritten with zeros becomes a zero block */
+				if (write && length == _md->block_size && !_alloc.job &&
+				    _flush.state != Flush::META && skip_zeros(length)) {
+					_discard_block(sector_to_block(nr));
+					return true;
 				}
 
-				auto const memset_size = Genode::min(dst_size - dst_offset, max_offset_read);
-				if (memset_size > ~0UL) {
-					Genode::error("memset size too large on 32bit");
-					return false;
+				if (write && image) {
+					/* copy on write of a block provided by a parent */
+					uint64_t const dis = (nr % sectors_per_block()) *
+					                     _md->sector_size;
+					return allocate(length, image, offset - dis);
 				}
 
-				__builtin_memset(dst + dst_offset, 0, (unsigned long)(memset_size));
+				/* one VFS operation for blocks stored back to back */
+				uint64_t const bid = sector_to_block(nr);
 
-				if (memset_size == dst_size - dst_offset) {
-					response = Response::ACCEPTED;
-					_state_fs_read.dst_offset = 0;
-					return false;
-				}
+				length += _contiguous(bid, image, remaining - length);
 
-				_state_fs_read.dst_offset += memset_size;
+				if (write)
+					for (uint64_t b = bid; b <= sector_to_block(nr + (length - 1) /
+					                                            _md->sector_size); b++)
+						_discard_invalidate(b);
 
-				auto const blocks = memset_size / _block_ops.block_size;
+				if (write)
+					job.io.write(offset, length);
+				else
+					job.io.read(offset, length);
 
-				if (operation.count < blocks) {
-					Genode::error("read - count of blocks is too small ");
-					return false;
-				}
+				job.io_handle = &job.image(image);
 
-				_state_fs_read.operation = operation;
-				_state_fs_read.operation.block_number += blocks;
-				_state_fs_read.operation.count -= ::Block::block_count_t(blocks); /* size checked above */
+				return true;
+			});
 
-				return true; /* loop retry */
-			}, [&](uint64_t const offset, uint32_t const max_offset_read) {
+			if (!next)
+				break;
 
-				if (dst_offset > dst_size || dst_size - dst_offset != len) {
-					Genode::error("partial reads, error ahead");
-					response = Response::REJECTED;
-					return false;
-				}
+			/* segment got finished without any I/O */
+			if (job.io.idle())
+				continue;
+		}
+
+		char * const segment = buffer + job.done;
+
+		auto const result = write ? _write(*job.io_handle, job.io, segment)
+		                          : _read (*job.io_handle, job.io, segment);
 
-				response = _read_split(operation, dst + dst_offset,
-				                       dst_size - dst_offset,
-				                       offset, max_offset_read);
+		if (result == Vdi::Io::PENDING)
+			break;
+
+		progress = true;
+
+		if (result != Vdi::Io::DONE) {
+			Genode::error(write ? "write" : "read", " failed at block ",
+			              job.request.operation.block_number, "+",
+			              job.request.operation.count);
+			job.finish(false);
+			break;
+		}
+
+		job.done += job.io.size;
+	}
+
+	return progress;
+}
+
+/*
+ * Bytes of the blocks following 'bid' that are stored physically contiguous
+ * in 'image', up to 'limit', only present table pages are looked at
+ */
+Genode::Vfs::file_size Vdi::File::_contiguous(uint64_t const bid, unsigned const image,
+                                Genode::Vfs::file_size const limit)
+{
+	/* extra data in front of each block interrupts the run */
+	if (_md->block_extra)
+		return 0;
+
+	auto const physical = [&] (uint64_t const b, uint32_t &pid) {
+		if (b >= _md->max_blocks || !_table->present(b))
+			return false;
+
+		Vdi::Block const block = _table->block(b);
+
+		if (!image) {
+			pid = block.value;
+			return block.allocated();
+		}
 
-				if (response == Response::ACCEPTED &&
-				    _state_fs_read.operation.type != ::Block::Operation::Type::INVALID)
-					return true; /* loop retry */
+		pid = _chain.block[b];
+		return block.free() && _chain.image[b] == image;
+	};
 
-				return false;
+	uint32_t pid = 0;
+	if (!physical(bid, pid))
+		return 0;
+
+	uint64_t run = 0;
+
+	for (uint32_t next = 0;
+	     run * _md->block_size < limit && physical(bid + run + 1, next) &&
+	     next == pid + 1;
+	     pid = next)
+		run++;
+
+	return Genode::min(run * _md->block_size, limit);
+}
+
+/*
+ * Fixed images need neither table lookup nor allocation, the whole request
+ * is executed as one VFS operation
+ */
+bool Vdi::File::_execute_fixed(Vdi::Job &job, char * const buffer)
+{
+	bool const write = job.type(::Block::Operation::Type::WRITE);
+
+	Genode::Vfs::file_size const total = job.request.operation.count *
+	                                     _block_ops.block_size;
+
+	if (job.io.idle()) {
+		uint64_t const nr    = job.request.operation.block_number;
+		uint64_t const count = Genode::max(uint64_t(job.request.operation.count), uint64_t(1));
+
+		/* the mapping is verified on loading the table pages */
+		for (uint64_t bid = sector_to_block(nr);
+		     bid <= sector_to_block(nr + count - 1); bid++) {
+
+			if (_present(bid))
+				continue;
+
+			if (_fault) {
+				job.finish(false);
+				return true;
+			}
+			return false;
+		}
+
+		if (!_fixed)
+			return _execute_rw(job, buffer);
+
+		Genode::Vfs::file_offset const offset = _md->data_offset +
+			nr * _block_ops.block_size;
+
+		/* continued by '_execute_rw' if the table path is taken meanwhile */
+		job.io_handle = job.handle;
+
+		if (write)
+			job.io.write(offset, total);
+		else
+			job.io.read(offset, total);
+	}
+
+	auto const result = write ? _write(*job.io_handle, job.io, buffer)
+	                          : _read (*job.io_handle, job.io, buffer);
+
+	if (result == Vdi::Io::PENDING)
+		return false;
+
+	if (result != Vdi::Io::DONE)
+		Genode::error(write ? "write" : "read", " failed at block ",
+		              job.request.operation.block_number, "+",
+		              job.request.operation.count);
+
+	job.finish(result == Vdi::Io::DONE);
+
+	return true;
+}
+
+/*
+ * Reads are answered from the cache if all sectors are valid, otherwise
+ * the data is read and merged with the cache. Writes go to the cache only.
+ */
+bool Vdi::File::_execute_cached(Vdi::Job &job, char * const buffer)
+{
+	if (job.type(::Block::Operation::Type::WRITE))
+		return _cache_write(job, buffer);
+
+	::Block::Operation const &op = job.request.operation;
+
+	if (!job.miss) {
+		bool hit = true;
+
+		_cache->for_each_part(op.block_number, op.count,
+		                      [&] (uint64_t const index, unsigned const first,
+		                           unsigned const num, uint64_t) {
+			Vdi::Cache::Page const * const page = _cache->lookup(index);
+			uint64_t const mask = Vdi::Cache::mask(first, num);
+
+			if (!page || (page->valid & mask) != mask)
+				hit = false;
+		});
+
+		if (!hit) {
+			job.miss       = true;
+			job.generation = _cache->generation();
+			_cache->stats.misses ++;
+		} else {
+			_cache->for_each_part(op.block_number, op.count,
+			                      [&] (uint64_t const index, unsigned const first,
+			                           unsigned const num, uint64_t const offset) {
+				Vdi::Cache::Page const &page = *_cache->lookup(index);
+
+				Genode::memcpy(buffer + offset,
+				               _cache->content(page) + first * _cache->sector_size(),
+				               num * _cache->sector_size());
 			});
-		} while (loop);
+
+			_cache->stats.hits ++;
+			job.finish(true);
+			return true;
+		}
+	}
+
+	bool const progress = _execute_io(job, buffer);
+
+	if (job.complete() && job.request.success)
+		_cache_fill(job, buffer);
+
+	return progress;
+}
+
+bool Vdi::File::_cache_write(Vdi::Job &job, char const * const buffer)
+{
+	bool progress = false;
+
+	Genode::size_t const sector_size = _cache->sector_size();
+
+	/* 'done' counts the bytes already in the cache */
+	uint64_t const nr    = job.request.operation.block_number + job.done / sector_size;
+	uint64_t const count = job.request.operation.count        - job.done / sector_size;
+
+	bool waiting = false;
+
+	_cache->for_each_part(nr, count,
+	                      [&] (uint64_t const index, unsigned const first,
+	                           unsigned const num, uint64_t) {
+		if (waiting)
+			return;
+
+		Vdi::Cache::Page *page = _cache->lookup(index);
+		if (!page)
+			page = _cache->alloc(index);
+
+		/* all pages dirty, wait for the write back */
+		if (!page) {
+			waiting = true;
+			return;
+		}
+
+		uint64_t const mask = Vdi::Cache::mask(first, num);
+
+		Genode::memcpy(_cache->content(*page) + first * sector_size,
+		               buffer + job.done, num * sector_size);
+
+		page->valid     |= mask;
+		page->dirty     |= mask;
+		page->rewritten |= mask & page->writing;
+
+		_cache->modified(*page);
+
+		job.done += num * sector_size;
+		progress  = true;
 	});
 
-	return response;
+	if (!waiting)
+		job.finish(true);
+
+	/* keep clean pages available */
+	if (waiting || _cache->dirty_pages() > _cache->pages() / 2)
+		_cache_writeback();
+
+	return progress || !waiting;
+}
+
+/*
+ * Merge data read with the cache, valid sectors of the cache are more
+ * recent than the file content. The data read is not cached if the
+ * sectors may have been modified since the read started, e.g., written
+ * to the cache, written back and evicted meanwhile.
+ */
+void Vdi::File::_cache_fill(Vdi::Job &job, char * const buffer)
+{
+	Genode::size_t const sector_size = _cache->sector_size();
+
+	bool const dropped = _cache->dropped_since(job.generation);
+
+	_cache->for_each_part(job.request.operation.block_number,
+	                      job.request.operation.count,
+	                      [&] (uint64_t const index, unsigned const first,
+	                           unsigned const num, uint64_t const offset) {
+		Vdi::Cache::Page *page = _cache->lookup(index);
+		if (!page && !dropped)
+			page = _cache->alloc(index);
+
+		if (!page)
+			return;
+
+		bool const fill = !dropped && page->modified <= job.generation;
+
+		for (unsigned s = first; s < first + num; s++) {
+			uint64_t const bit = 1ull << s;
+
+			char * const cached = _cache->content(*page) + s * sector_size;
+			char * const data   = buffer + offset + (s - first) * sector_size;
+
+			if (page->valid & bit)
+				Genode::memcpy(data, cached, sector_size);
+			else if (fill) {
+				Genode::memcpy(cached, data, sector_size);
+				page->valid |= bit;
+			}
+		}
+	});
 }
 
-Vdi::File::Response
-Vdi::File::_vdi_write(::Block::Request const & request,
-                      ::Block::Request_stream::Payload const &payload)
+/*
+ * Start write back of the least recently used dirty pages, one run of
+ * dirty sectors per page and free write-back job
+ */
+void Vdi::File::_cache_writeback()
 {
-	Response response {Response::REJECTED};
+	for (auto &job : _writeback) {
+		if (!job.free())
+			continue;
 
-	if (_state_fs.state != Write::WRITE) {
-		if (_state_fs.state != Write::IDLE)
-			_execute_alloc_block();
+		Vdi::Cache::Page * const page = _cache->oldest_dirty();
+		if (!page)
+			return;
 
-		if (_state_fs.state != Write::IDLE)
-			return Response::RETRY;
+		unsigned first = 0;
+		while (!(page->dirty & (1ull << first)))
+			first++;
+
+		unsigned last = first;
+		while (last < _cache->sectors() && (page->dirty & (1ull << last)))
+			last++;
+
+		page->writing   = Vdi::Cache::mask(first, last - first);
+		page->rewritten = 0;
+
+		::Block::Request request { };
+		request.operation.type         = ::Block::Operation::Type::WRITE;
+		request.operation.block_number = page->index * _cache->sectors() + first;
+		request.operation.count        = last - first;
+
+		job.submit(request, _cache->content(*page) + first * _cache->sector_size());
+		job.state = Vdi::Job::IN_PROGRESS;
+		job.page  = page;
+
+		_cache->stats.writebacks ++;
 	}
+}
+
+/*
+ * Drive write backs, returns true if any made progress
+ */
+bool Vdi::File::_execute_writeback()
+{
+	bool progress = false;
 
-	Genode::Vfs::file_size dst_offset = 0;
+	for (auto &job : _writeback) {
+		if (!job.active())
+			continue;
 
-	::Block::Operation operation = request.operation;
+		if (_execute_io(job, job.buffer))
+			progress = true;
 
-	bool loop = false;
+		if (!job.complete())
+			continue;
 
-	do {
-		if (_state_fs.operation.type != ::Block::Operation::Type::INVALID) {
-			operation  = _state_fs.operation;
-			dst_offset = _state_fs.dst_offset;
+		Vdi::Cache::Page &page = *job.page;
 
-#if 0
-			Genode::log("write ", request.operation.block_number, "+", request.operation.count,
-				        " -> ", _state_fs.operation.block_number, "+", _state_fs.operation.count,
-				        " - dst_offset=", dst_offset);
-#endif
+		/* sectors modified meanwhile stay dirty */
+		if (job.request.success)
+			page.dirty &= ~(page.writing & ~page.rewritten);
+		else {
+			Genode::error("cache write back failed - out of service");
+			_fault = true;
 		}
 
-		bool const cross_vdi_block = _cross_vdi_block(operation);
+		page.writing   = 0;
+		page.rewritten = 0;
 
-		loop = _apply_block(operation.block_number, [&](Genode::uint32_t) {
-			if (_state_fs.state == Write::WRITE) {
-				Genode::error("during data write sector in vdi vanished ?");
-				_state_fs.state = Write::ERROR;
-				response = Response::REJECTED;
-				return false;
-			}
+		_write_seq ++;
 
-			_allocate_block(operation.block_number);
+		job.page   = nullptr;
+		job.buffer = nullptr;
+		job.release();
+	}
 
-			if (_state_fs.state == ALLOC_BLOCK_SYNC_QUEUED ||
-			    _state_fs.state == ALLOC_BLOCK_SYNC ||
-			    _state_fs.state == SYNC_HEADER ||
-			    _state_fs.state == SYNC_HEADER_1 ||
-			    _state_fs.state == SYNC_HEADER_2 ||
-			    _state_fs.state == ALLOC_BLOCK) {
+	return progress;
+}
 
-				response = Response::RETRY;
-				return false;
-			}
+/*
+ * Drop cached sectors of a TRIM range, no write back is running
+ */
+void Vdi::File::_cache_invalidate(uint64_t const nr, uint64_t const count)
+{
+	/* keep reads in flight from filling in the old content */
+	_cache->discarded();
+
+	_cache->for_each_part(nr, count,
+	                      [&] (uint64_t const index, unsigned const first,
+	                           unsigned const num, uint64_t) {
+		Vdi::Cache::Page * const page = _cache->lookup(index);
+		if (!page)
+			return;
+
+		uint64_t const mask = Vdi::Cache::mask(first, num);
+
+		page->valid &= ~mask;
+		page->dirty &= ~mask;
+
+		if (!page->valid)
+			_cache->release(*page);
+	});
+}
+
+void Vdi::File::_cache_report()
+{
+	if (!_cache_reporter.constructed())
+		return;
+
+	Vdi::Cache::Stats const &stats = _cache->stats;
+
+	uint64_t const requests = stats.hits + stats.misses;
+
+	_cache_reporter->generate([&] (Genode::Generator &g) {
+		g.attribute("pages",       _cache->pages());
+		g.attribute("dirty_pages", _cache->dirty_pages());
+		g.attribute("hits",        stats.hits);
+		g.attribute("misses",      stats.misses);
+		g.attribute("hit_ratio",   requests ? stats.hits * 100 / requests : 0);
+		g.attribute("writebacks",  stats.writebacks);
+	});
+}
+
+/*
+ * Writes go to the overlay only, reads covered by the overlay completely
+ * need no I/O, otherwise the data read from the image is merged with it
+ */
+bool Vdi::File::_execute_overlay(Vdi::Job &job, char * const buffer)
+{
+	::Block::Operation const &op = job.request.operation;
+
+	Genode::size_t const sector_size = _overlay->sector_size();
+
+	if (job.type(::Block::Operation::Type::WRITE)) {
+		bool exhausted = false;
+
+		_overlay->for_each_part(op.block_number, op.count,
+		                        [&] (uint64_t const bid, unsigned const first,
+		                             unsigned const num, uint64_t const offset) {
+			if (exhausted)
+				return;
 
-			if (_state_fs.state != Write::IDLE) {
-				Genode::error("unknown state Block::Write state_fs=",
-				              (int)_state_fs.state);
-				response = Response::REJECTED;
-				return false;
+			Vdi::Overlay::Block *block = _overlay->lookup(bid);
+			if (!block)
+				block = _overlay->alloc(bid);
+
+			if (!block) {
+				exhausted = true;
+				return;
 			}
 
+			Genode::memcpy(_overlay->content(*block) + first * sector_size,
+			               buffer + offset, num * sector_size);
+
+			_overlay->write(*block, first, num);
+		});
+
+		if (exhausted)
+			Genode::error("overlay exhausted, write failed at block ",
+			              op.block_number, "+", op.count);
+
+		job.finish(!exhausted);
+		return true;
+	}
+
+	if (!job.miss) {
+		bool covered = true;
+
+		_overlay->for_each_part(op.block_number, op.count,
+		                        [&] (uint64_t const bid, unsigned const first,
+		                             unsigned const num, uint64_t) {
+			Vdi::Overlay::Block const * const block = _overlay->lookup(bid);
+
+			if (!block || !_overlay->written(*block, first, num))
+				covered = false;
+		});
+
+		if (covered) {
+			_overlay_merge(job, buffer);
+			job.finish(true);
 			return true;
-		}, [&](uint64_t const offset, Genode::Vfs::file_size const max_offset_write) {
+		}
 
-			Genode::Vfs::file_size const len = operation.count * _block_ops.block_size;
-			bool retry = false;
+		job.miss = true;
+	}
 
-			payload.with_content(request, [&] (void *addr, Genode::size_t const dst_size) {
-				char * dst = reinterpret_cast<char *>(addr);
+	bool const progress = _execute_io(job, buffer);
 
-				if (dst_offset > dst_size || len < dst_size - dst_offset) {
-					Genode::error("remaining size to write is bogus - stop");
-					_state_fs.state  = Write::ERROR;
-					return;
-				}
+	if (job.complete() && job.request.success)
+		_overlay_merge(job, buffer);
 
-				if (_state_fs.state == Write::IDLE) {
-					_state_fs.block_nr = operation.block_number;
-					_state_fs.written  = 0;
-					_state_fs.max      = Genode::min(max_offset_write, len);
-					_state_fs.state    = Write::WRITE;
-				}
+	return progress;
+}
 
-				if (_state_fs.max > dst_size - dst_offset) {
-					Genode::error("write larger than buffer - stop");
-					_state_fs.state  = Write::ERROR;
-					return;
-				}
+/*
+ * Copy sectors written to the overlay over the data read
+ */
+void Vdi::File::_overlay_merge(Vdi::Job const &job, char * const buffer)
+{
+	Genode::size_t const sector_size = _overlay->sector_size();
+
+	_overlay->for_each_part(job.request.operation.block_number,
+	                        job.request.operation.count,
+	                        [&] (uint64_t const bid, unsigned const first,
+	                             unsigned const num, uint64_t const offset) {
+		Vdi::Overlay::Block * const block = _overlay->lookup(bid);
+		if (!block)
+			return;
 
-				if (_state_fs.state == Write::WRITE) {
-
-					_write(dst + dst_offset, dst_size - dst_offset, offset);
-
-					if (_state_fs.written >= _state_fs.max) {
-						_state_fs.state = Write::IDLE;
-
-						if (!cross_vdi_block) {
-							_state_fs.operation.type = ::Block::Operation::Type::INVALID;
-							_state_fs.dst_offset = 0;
-						} else {
-							auto const blocks = _state_fs.max / _block_ops.block_size;
-
-							if (operation.count < blocks) {
-								Genode::error("write - count of blocks is too small ", operation.count, " ", blocks);
-								response = Response::REJECTED;
-								return;
-							}
-
-							_state_fs.operation = operation;
-							_state_fs.operation.block_number += blocks;
-							_state_fs.operation.count -= ::Block::block_count_t(blocks); /* size checked above */
-
-							if (_state_fs.operation.count == 0) {
-								_state_fs.operation.type = ::Block::Operation::Type::INVALID;
-								_state_fs.dst_offset = 0;
-								/* we should ever get into !cross_vdi_block case */
-								Genode::warning("write - insane state");
-							} else {
-#if 0
-								Genode::log("partial write done ",
-								            _state_fs.written, "/", _state_fs.max, " vs ", len,
-								            " -> next"
-								            " block_number=", _state_fs.operation.block_number,
-								            " count=", _state_fs.operation.count);
-#endif
-
-								_state_fs.dst_offset += _state_fs.max;
-								dst_offset += _state_fs.max;
-								retry = true;
-							}
-						}
-					}
+		for (unsigned s = first; s < first + num; s++)
+			if (_overlay->written(*block, s))
+				Genode::memcpy(buffer + offset + (s - first) * sector_size,
+				               _overlay->content(*block) + s * sector_size,
+				               sector_size);
+	});
+}
 
-					if (_state_fs.state == Write::IDLE)
-						response = Response::ACCEPTED;
-					else
-						response = Response::RETRY;
-				}
-			});
+/*
+ * Discarded sectors read as the image content again
+ */
+void Vdi::File::_overlay_discard(::Block::Operation const &op)
+{
+	_overlay->for_each_part(op.block_number, op.count,
+	                        [&] (uint64_t const bid, unsigned const first,
+	                             unsigned const num, uint64_t) {
+		Vdi::Overlay::Block * const block = _overlay->lookup(bid);
+		if (block)
+			_overlay->discard(*block, first, num);
+	});
+}
+
+/*
+ * Detect sequential streams of read requests per client
+ */
+void Vdi::File::_readahead_track(unsigned const client, ::Block::Request const &request)
+{
+	Vdi::Readahead &ra = _readahead[client];
+
+	::Block::Operation const &op = request.operation;
+
+	if (op.block_number == ra.next_nr) {
+		if (ra.sequential < ~0u)
+			ra.sequential ++;
+	} else {
+		if (ra.sequential >= READAHEAD_STREAM) {
+			_readahead_stats.streams ++;
+			_readahead_report();
+		}
+
+		ra.sequential = 0;
+		ra.window     = _readahead_initial();
+	}
+
+	ra.next_nr = op.block_number + op.count;
+}
+
+/*
+ * Answer read from the prefetched data, a miss of a sequential stream
+ * starts the prefetch of the data following the request
+ */
+Vdi::File::Prefetched Vdi::File::_readahead_lookup(Vdi::Job &job)
+{
+	Vdi::Readahead &ra = _readahead[job.client];
+
+	::Block::Operation const &op = job.request.operation;
+
+	if (ra.covers(op.block_number, op.count)) {
+		if (ra.job.active())
+			return Prefetched::WAIT;
+
+		if (ra.valid) {
+			Genode::size_t const block_size = _block_ops.block_size;
+
+			Genode::memcpy(job.buffer,
+			               ra.buffer->local_addr<char>() +
+			               (op.block_number - ra.nr) * block_size,
+			               op.count * block_size);
+
+			if (_overlay.constructed())
+				_overlay_merge(job, job.buffer);
+
+			job.finish(true);
+
+			ra.used = true;
+			_readahead_stats.hits ++;
+
+			/* buffer consumed, continue with a larger window */
+			if (op.block_number + op.count == ra.nr + ra.count) {
+				ra.window = Genode::min(ra.window * 2, _readahead_max);
+				_readahead_start(job.client, ra.nr + ra.count);
+			}
+
+			return Prefetched::HIT;
+		}
+	}
+
+	if (ra.sequential < READAHEAD_STREAM)
+		return Prefetched::MISS;
 
-			return retry; /* loop */
+	_readahead_stats.misses ++;
+
+	_readahead_start(job.client, op.block_number + op.count);
+
+	return Prefetched::MISS;
+}
+
+/*
+ * Prefetch from sector 'nr' within its VDI block and the blocks stored
+ * physically contiguous after it, blocks not allocated read as zeros
+ * anyway and are not prefetched
+ */
+void Vdi::File::_readahead_start(unsigned const client, uint64_t const nr)
+{
+	Vdi::Readahead &ra = _readahead[client];
+
+	if (ra.job.active() || nr >= _block_ops.block_count)
+		return;
+
+	Genode::size_t const block_size = _block_ops.block_size;
+
+	Genode::Vfs::file_size bytes = Genode::min(Genode::Vfs::file_size(ra.window),
+	                                           (_block_ops.block_count - nr) * block_size);
+
+	uint64_t const bid = sector_to_block(nr);
+
+	/* speculative reads do not load table pages */
+	if (!_table->present(bid))
+		return;
+
+	if (!_fixed) {
+		bytes = _apply_block(nr, [&] (uint32_t) {
+			return Genode::Vfs::file_size(0);
+		}, [&] (unsigned const image, uint64_t, uint32_t const max) {
+			Genode::Vfs::file_size const length = Genode::min(bytes,
+			                                                  Genode::Vfs::file_size(max));
+			return length + _contiguous(bid, image, bytes - length);
 		});
+	}
+
+	uint64_t const count = bytes / block_size;
+	if (!count)
+		return;
+
+	/* prefetched data not used, the window was too large */
+	if (ra.valid && !ra.used)
+		ra.window = Genode::max(ra.window / 2, _readahead_initial());
+
+	if (!ra.buffer.constructed())
+		ra.buffer.construct(_env.ram(), _env.rm(), _readahead_max);
+
+	::Block::Request request { };
+	request.operation.type         = ::Block::Operation::Type::READ;
+	request.operation.block_number = nr;
+	request.operation.count        = count;
+
+	ra.job.submit(request, ra.buffer->local_addr<char>());
+	ra.job.state  = Vdi::Job::IN_PROGRESS;
+	ra.job.client = client;
+
+	ra.nr    = nr;
+	ra.count = count;
+	ra.valid = false;
+	ra.used  = false;
+	ra.stale = false;
+}
+
+/*
+ * Drive the prefetch of the client, returns true on progress
+ */
+bool Vdi::File::_execute_readahead(unsigned const client)
+{
+	Vdi::Readahead &ra = _readahead[client];
+
+	if (!ra.job.active())
+		return false;
+
+	bool const progress = _execute_io(ra.job, ra.job.buffer);
+
+	if (!ra.job.complete())
+		return progress;
+
+	if (ra.job.request.success && !ra.stale)
+		ra.valid = true;
+	else
+		ra.invalidate();
+
+	ra.job.release();
 
-	} while (loop);
+	return true;
+}
+
+/*
+ * Drop prefetched data overlapping a completed write or discard, a prefetch
+ * in flight may have read the old content
+ */
+void Vdi::File::_readahead_invalidate(::Block::Operation const &op)
+{
+	for (auto &ra : _readahead) {
+		if (!ra.overlaps(op.block_number, op.count))
+			continue;
+
+		if (ra.job.active())
+			ra.stale = true;
+		else
+			ra.invalidate();
+	}
+}
+
+void Vdi::File::_readahead_report()
+{
+	if (!_readahead_reporter.constructed())
+		return;
+
+	uint64_t const requests = _readahead_stats.hits + _readahead_stats.misses;
+
+	_readahead_reporter->generate([&] (Genode::Generator &g) {
+		g.attribute("window_max", _readahead_max);
+		g.attribute("hits",       _readahead_stats.hits);
+		g.attribute("misses",     _readahead_stats.misses);
+		g.attribute("hit_ratio",  requests ? _readahead_stats.hits * 100 / requests : 0);
+		g.attribute("streams",    _readahead_stats.streams);
+
+		for (unsigned i = 0; i < MAX_CLIENTS; i++) {
+			if (!_clients[i].cap.valid())
+				continue;
+
+			g.node("session", [&] {
+				g.attribute("id",         i);
+				g.attribute("window",     _readahead[i].window);
+				g.attribute("sequential", _readahead[i].sequential >= READAHEAD_STREAM);
+			});
+		}
+	});
+}
+
+bool Vdi::File::_execute_sync(Vdi::Job &job)
+{
+	/* nothing is ever written to the image */
+	if (_overlay.constructed()) {
+		job.finish(true);
+		return true;
+	}
+
+	if (_flush.job != &job) {
+		if (_fault) {
+			job.finish(false);
+			return true;
+		}
+
+		/* all writes completed before got flushed already */
+		if (job.seq <= _synced_seq) {
+			_stats.syncs_skipped ++;
+			job.finish(true);
+			return true;
+		}
+
+		/* cached data is written back before the metadata */
+		if (!_cache_clean()) {
+			_cache_writeback();
+			return false;
+		}
+
+		/*
+		 * Wait for a running flush, which covers the writes of the job
+		 * if started after them, so overlapping SYNCs share one flush
+		 */
+		if (!_start_flush(&job))
+			return false;
+	}
+
+	_execute_flush();
+
+	if (_flush.state != Flush::DONE && _flush.state != Flush::ERROR)
+		return false;
+
+	if (_flush.state == Flush::ERROR) {
+		Genode::error("sync fault - out of service");
+		_fault = true;
+	}
 
-	return response;
+	job.finish(_flush.state == Flush::DONE);
+
+	if (_stats_timer.constructed())
+		_stats.flush.add(_now() - _flush.started);
+
+	if (_flush.state == Flush::DONE) {
+		_synced_seq = Genode::max(_synced_seq, _flush.seq);
+		_md->persisted(_flush.released);
+	}
+
+	_flush.state = Flush::IDLE;
+	_flush.job   = nullptr;
+
+	/* SYNC requests of other sessions may be covered by the flush */
+	_notify();
+
+	if (_cache.constructed())
+		_cache_report();
+
+	_readahead_report();
+
+	return true;
+}
+
+void Vdi::File::_discard_block(uint64_t const bid)
+{
+	if (bid >= _md->max_blocks || _table->block(bid).zero())
+		return;
+
+	/*
+	 * The block is reused after a flush made the zero entry durable, if
+	 * not remembered, the space is reclaimed on compaction
+	 */
+	(void)_md->zero_block(bid);
+
+	_mark_dirty();
+
+	_discard_invalidate(bid);
+}
+
+void Vdi::File::_discard_partial(uint64_t const bid, unsigned const first,
+                                 unsigned const count)
+{
+	if (bid >= _md->max_blocks || !_table->block(bid).allocated())
+		return;
+
+	Vdi::Discard *slot = nullptr;
+
+	for (auto &d : _discard)
+		if (d.bid == bid) slot = &d;
+
+	if (!slot) {
+		/* blocks with too many sectors are reclaimed by compaction only */
+		if (sectors_per_block() > Vdi::Discard::MAX_SECTORS)
+			return;
+
+		slot = &_discard[_discard_next];
+		_discard_next = (_discard_next + 1) % DISCARD_SLOTS;
+
+		slot->track(bid, sectors_per_block());
+	}
+
+	if (slot->discard(first, count))
+		_discard_block(bid);
+}
+
+bool Vdi::File::_execute_trim(Vdi::Job &job)
+{
+	if (_overlay.constructed()) {
+		_overlay_discard(job.request.operation);
+		job.finish(true);
+		return true;
+	}
+
+	/* the block table must not change during allocation and write back */
+	if (_alloc.job || _flush.state == Flush::META)
+		return false;
+
+	/* cached data of the range is dropped, which is not possible during write back */
+	if (_cache.constructed()) {
+		if (_writeback_active())
+			return false;
+
+		_cache_invalidate(job.request.operation.block_number + job.done,
+		                  job.request.operation.count        - job.done);
+	}
+
+	/* blocks of fixed images stay in place */
+	if (_fixed) {
+		job.finish(true);
+		return true;
+	}
+
+	uint64_t const start = job.request.operation.block_number;
+	uint64_t const end   = start + job.request.operation.count;
+	uint64_t       nr    = start + job.done;
+
+	while (nr < end) {
+		uint64_t const bid   = sector_to_block(nr);
+		unsigned const first = unsigned(nr % sectors_per_block());
+		unsigned const count = unsigned(Genode::min(uint64_t(sectors_per_block() - first),
+		                                            end - nr));
+
+		/* wait for the table page, 'done' counts the sectors processed */
+		if (!_present(bid)) {
+			if (_fault)
+				job.finish(false);
+
+			bool const progress = _fault || job.done != nr - start;
+
+			job.done = nr - start;
+			return progress;
+		}
+
+		if (count == sectors_per_block())
+			_discard_block(bid);
+		else
+			_discard_partial(bid, first, count);
+
+		nr += count;
+	}
+
+	job.finish(true);
+
+	return true;
+}
+
+
+/*
+ * Account request handed back for acknowledgement, 'submitted' and 'now'
+ * in microseconds
+ */
+void Vdi::File::_stats_acked(::Block::Request const &request,
+                             uint64_t const submitted, uint64_t const now)
+{
+	using Type = ::Block::Operation::Type;
+
+	uint64_t const bytes   = request.operation.count * _block_ops.block_size;
+	uint64_t const latency = now > submitted ? now - submitted : 0;
+
+	switch (request.operation.type) {
+	case Type::READ:  _stats.read .add(bytes, latency); break;
+	case Type::WRITE: _stats.write.add(bytes, latency); break;
+	case Type::SYNC:  _stats.sync .add(0,     latency); break;
+	case Type::TRIM:  _stats.trim .add(bytes, latency); break;
+	default: break;
+	}
+}
+
+void Vdi::File::_stats_report()
+{
+	_stats_reporter->generate([&] (Genode::Generator &g) {
+		g.attribute("interval_ms", _stats_interval.value / 1000);
+		g.attribute("fault",       _fault);
+		_stats.generate(g);
+	});
 }
@@ -20,76 +20,244 @@
 #include <base/heap.h>
 #include <base/log.h>
 #include <block/request_stream.h>
+#include <timer_session/connection.h>
 #include <block_session/block_session.h>
+#include <os/reporter.h>
 #include <util/string.h>
 #include <vfs/simple_env.h>
 
 #include <vfs/print.h>
 
 /* local includes */
+#include <vdi_cache.h>
+#include <vdi_meta_data.h>
+#include <vdi_overlay.h>
+#include <vdi_stats.h>
+#include <vdi_table.h>
 #include <vdi_types.h>
 
 namespace Vdi {
-	struct Block;
-	struct Meta_data;
+	struct Discard;
+	struct Io;
+	struct Job;
+	struct Readahead;
 	struct File;
 } /* namespace Vdi */
 
 
-struct Vdi::Block
+/*
+ * Sectors of a VDI block discarded by TRIM so far, to detect when a block
+ * got discarded completely by several partial TRIM requests
+ */
+struct Vdi::Discard
+{
+	enum { MAX_SECTORS = 8192 };
+
+	uint64_t bid     { ~0ull };
+	unsigned sectors { 0 };
+	unsigned count   { 0 };
+	uint64_t bits[MAX_SECTORS / 64] { };
+
+	bool valid() const { return bid != ~0ull; }
+
+	void invalidate() { bid = ~0ull; }
+
+	void track(uint64_t const block, unsigned const sectors_per_block)
+	{
+		bid     = block;
+		sectors = sectors_per_block;
+		count   = 0;
+
+		for (auto &b : bits) b = 0;
+	}
+
+	/* returns true if all sectors of the block are discarded */
+	bool discard(unsigned const first, unsigned const num)
+	{
+		for (unsigned s = first; s < first + num && s < sectors; s++) {
+			if (bits[s / 64] & (1ull << (s % 64)))
+				continue;
+
+			bits[s / 64] |= 1ull << (s % 64);
+			count++;
+		}
+
+		return count == sectors;
+	}
+};
+
+
+/*
+ * Pending VFS operation on a file handle, which may be resumed several times
+ */
+struct Vdi::Io
 {
-	uint32_t value;
+	enum State { IDLE, READ, READ_QUEUED, WRITE, SYNC, SYNC_QUEUED };
 
-	enum {
-		BLOCK_FREE = ~0u,
-		BLOCK_ZERO = ~1u,
-	};
+	enum Result { DONE, PENDING, END, ERROR };
 
-	bool zero()      const { return value == BLOCK_ZERO; }
-	bool free()      const { return value == BLOCK_FREE; }
-	bool allocated() const { return value  < BLOCK_FREE; }
+	State                    state  { IDLE };
+	Genode::Vfs::file_offset offset { 0 };
+	Genode::Vfs::file_size   size   { 0 };
+	Genode::Vfs::file_size   done   { 0 };
+
+	bool idle() const { return state == IDLE; }
+
+	void _start(State s, Genode::Vfs::file_offset o, Genode::Vfs::file_size n)
+	{
+		state  = s;
+		offset = o;
+		size   = n;
+		done   = 0;
+	}
+
+	void read (Genode::Vfs::file_offset o, Genode::Vfs::file_size n) { _start(READ,  o, n); }
+	void write(Genode::Vfs::file_offset o, Genode::Vfs::file_size n) { _start(WRITE, o, n); }
+	void sync ()                                                      { _start(SYNC,  0, 0); }
 };
 
 
-struct Vdi::Meta_data
+/*
+ * Block request in flight, executed on its own VFS handle
+ */
+struct Vdi::Job
 {
-	uint32_t const blocks_offset;
-	uint32_t const data_offset;
+	enum State { FREE, PENDING, IN_PROGRESS, COMPLETE };
 
-	uint32_t const block_size;
-	uint32_t const sector_size;
+	/* max. number of parent images of a differencing image */
+	enum { MAX_PARENTS = 8 };
 
-	Vdi::Block *table            { nullptr };
-	uint32_t    max_blocks       { 0 };
-	uint32_t    allocated_blocks { 0 };
+	State                     state   { FREE };
+	::Block::Request          request { };
+	unsigned                  client  { 0 };
 
-	int fd { -1 };
+	/*
+	 * Requests merged into the job, 'request' covers all of them and the
+	 * parts are acknowledged individually
+	 */
+	enum { MAX_PARTS = 8 };
 
-	Meta_data(uint32_t blocks, uint32_t data,
-	          uint32_t block_size, uint32_t sector_size)
-	:
-		blocks_offset(blocks), data_offset(data),
-		block_size(block_size), sector_size(sector_size)
-	{ }
+	::Block::Request          parts[MAX_PARTS] { };
+	uint64_t                  part_time[MAX_PARTS] { }; /* submission in us */
+	unsigned                  part_count { 0 };
+	unsigned                  part_acked { 0 };
+	Genode::Vfs::Vfs_handle * handle  { nullptr };
+	Vdi::Io                   io      { };
 
-	template <typename T, typename E>
-	bool alloc_block(uint64_t const bid, T const &fn, E const &err)
+	/* read-only handles of the parent images */
+	Genode::Vfs::Vfs_handle * parent[MAX_PARENTS] { };
+
+	/* handle the current read is executed on */
+	Genode::Vfs::Vfs_handle * io_handle { nullptr };
+
+	Genode::Vfs::Vfs_handle &image(unsigned const i) {
+		return i ? *parent[i - 1] : *handle; }
+
+	/* bytes of the request already processed */
+	Genode::Vfs::file_size    done    { 0 };
+
+	/* payload of the request or data of a cache write back */
+	char               * buffer { nullptr };
+	Vdi::Cache::Page   * page   { nullptr };
+
+	/* read not answered by the cache or the overlay */
+	bool miss { false };
+
+	/* cache generation the missed read started at */
+	uint64_t generation { 0 };
+
+	/* completed writes a SYNC has to make durable */
+	uint64_t seq { 0 };
+
+	bool free()     const { return state == FREE; }
+	bool complete() const { return state == COMPLETE; }
+	bool active()   const { return state == PENDING || state == IN_PROGRESS; }
+
+	bool type(::Block::Operation::Type const t) const {
+		return request.operation.type == t; }
+
+	void submit(::Block::Request const &r, char * const data)
 	{
-		if (bid >= max_blocks) {
-			err();
-			return false;
-		}
+		request         = r;
+		buffer          = data;
+		parts[0]        = r;
+		part_count      = 1;
+		part_acked      = 0;
+		request.success = false;
+		done            = 0;
+		miss            = false;
+		io              = { };
+		state           = PENDING;
+	}
 
-		uint64_t const offset = uint64_t(data_offset) +
-		                        uint64_t(allocated_blocks) *
-		                        uint64_t(block_size);
-		if (!fn(offset))
-			return false;
+	/* request continues the job on disk and in the payload buffer */
+	bool mergeable(::Block::Request const &r, char const * const data,
+	               Genode::size_t const block_size, Genode::size_t const max) const
+	{
+		::Block::Operation const &op = request.operation;
+
+		return state == PENDING && part_count < MAX_PARTS &&
+		       type(r.operation.type) &&
+		       op.block_number + op.count == r.operation.block_number &&
+		       buffer + op.count * block_size == data &&
+		       (op.count + r.operation.count) * block_size <= max;
+	}
+
+	void merge(::Block::Request const &r)
+	{
+		parts[part_count++]      = r;
+		request.operation.count += r.operation.count;
+	}
+
+	void finish(bool const success)
+	{
+		request.success = success;
+		state           = COMPLETE;
+	}
+
+	void release() { state = FREE; }
+};
+
+
+/*
+ * Read-ahead of a client, the data following a stream of sequential reads
+ * is prefetched into the buffer
+ */
+struct Vdi::Readahead
+{
+	uint64_t       next_nr    { ~0ull }; /* sector expected next */
+	unsigned       sequential { 0 };     /* sequential requests in a row */
+	Genode::size_t window     { 0 };
+
+	/* sectors prefetched or in flight */
+	uint64_t nr    { 0 };
+	uint64_t count { 0 };
+	bool     valid { false };
+	bool     used  { false }; /* content was read by a request */
+	bool     stale { false }; /* a write completed during the prefetch */
+
+	Vdi::Job job { };
+
+	Genode::Constructible<Genode::Attached_ram_dataspace> buffer { };
+
+	bool covers(uint64_t const n, uint64_t const c) const {
+		return n >= nr && n + c <= nr + count; }
 
-		table[bid].value = allocated_blocks;
-		allocated_blocks++;
+	bool overlaps(uint64_t const n, uint64_t const c) const {
+		return n < nr + count && nr < n + c; }
 
-		return true;
+	void invalidate()
+	{
+		count = 0;
+		valid = false;
+	}
+
+	void reset(Genode::size_t const initial_window)
+	{
+		next_nr    = ~0ull;
+		sequential = 0;
+		window     = initial_window;
+		invalidate();
 	}
 };
 
@@ -175,6 +343,13 @@ class Vdi::File: Genode::Vfs::Read_ready_response_handler, Genode::Vfs::Env::Use
 		using Sync_result  = Genode::Vfs::File_io_service::Sync_result;
 		using Write_result = Genode::Vfs::File_io_service::Write_result;
 
+		typedef ::Block::Request_stream::Response Response;
+
+		enum { MAX_QUEUE_DEPTH = 64, MAX_CLIENTS = 8 };
+
+		/* max. size of merged requests */
+		enum { MAX_MERGE = 1u << 20 };
+
 		/**
 		 * Vfs::Read_ready_response_handler interface
 		 */
@@ -188,31 +363,26 @@ class Vdi::File: Genode::Vfs::Read_ready_response_handler, Genode::Vfs::Env::Use
 		 */
 		void wakeup_vfs_user() override
 		{
-#if 0
-			Genode::log("io response write=", (int)_state_fs.state,
-			            " read=", (int)_state_fs_read.state,
-			            " sync=", (int)_state_fs_sync.state,
-			            " cap=", _block_notify.cap);
-#endif
+			/* progress of a flush triggered by the timer */
+			if (_flush.state != Flush::IDLE && !_flush.job)
+				Genode::Signal_transmitter(_flush_handler).submit();
 
-			if (   (_state_fs_read.state == NONE || _state_fs_read.state == UNKNOWN)
-			    && (_state_fs_sync.state == Sync::IDLING || _state_fs_sync.state == Sync::FAULT)
-				&& (_state_fs.state == Write::IDLE || _state_fs.state == Write::ERROR))
+			if (_init == Init::DONE && !_active())
 				return;
 
-			if (_block_notify.cap.valid())
-				Genode::Signal_transmitter(_block_notify.cap).submit();
+			_notify();
 		}
 
-		void _execute_alloc_block();
-
 		File(File const &) = delete;
 		File operator=(File const&) = delete;
 
 		Genode::Env  &_env;
 		Genode::Heap  _heap { _env.ram(), _env.rm() };
 
-		Genode::Attached_ram_dataspace   _header_buffer { _env.ram(), _env.rm(), 2u<<20 };
+		/* header only, the block table is loaded on demand */
+		enum { HEADER_SIZE = 4096 };
+
+		Genode::Attached_ram_dataspace   _header_buffer { _env.ram(), _env.rm(), HEADER_SIZE };
 		Genode::Vfs::file_size           _header_size   { _header_buffer.size() };
 		char                           * _header_addr   { _header_buffer.local_addr<char>() };
 
@@ -226,330 +396,735 @@ class Vdi::File: Genode::Vfs::Read_ready_response_handler, Genode::Vfs::Env::Use
 
 		Genode::Constructible<Vdi::Meta_data> _md { };
 
-		enum Write {
-			ERROR,
-			IDLE,
-			ALLOC_BLOCK,
-			ALLOC_BLOCK_ERROR,
-			ALLOC_BLOCK_SYNC,
-			ALLOC_BLOCK_SYNC_QUEUED,
-			SYNC_HEADER,
-			SYNC_HEADER_1,
-			SYNC_HEADER_2,
-			SYNC_OK,
-			WRITE
+		/* memory for the pages of the block table */
+		Genode::size_t const _table_budget;
+
+		Genode::Constructible<Vdi::Table_cache> _table { };
+
+		/* handle to load table pages, one page at a time */
+		Genode::Vfs::Vfs_handle       * _table_file { nullptr };
+		Vdi::Table_cache::Page        * _page_in    { nullptr };
+		Vdi::Io                         _page_io    { };
+
+		bool _present(uint64_t);
+
+		bool _execute_page_in();
+
+		enum class Init { NONE, READ, PARENT, DONE, FAILED };
+
+		Init    _init    { Init::NONE };
+		Vdi::Io _init_io { };
+
+		/* set on metadata or sync errors, puts the device out of service */
+		bool _fault { false };
+
+		/* VFS handles opened by the component at most */
+		enum { MAX_HANDLES = 128 };
+
+		unsigned       _queue_depth;
+		Vdi::Job       _jobs[MAX_QUEUE_DEPTH] { };
+
+		/* size of VDI file, used to decide whether a block may become a hole */
+		Genode::Vfs::file_size _file_size { 0 };
+		bool                   _sparse    { true };
+
+		/*
+		 * The file is extended by several blocks at once, the part of the
+		 * extension not handed out yet starts at '_reserved' and is a hole
+		 */
+		unsigned const         _preallocate;
+		Genode::Vfs::file_size _reserved  { 0 };
+
+		/*
+		 * Parent chain of a differencing image, ordered from the direct
+		 * parent to the base image
+		 */
+		struct Parent {
+			Genode::String<256>       file;
+			Genode::Vfs::Vfs_handle * handle;
+			uint32_t                  data_offset;
 		};
 
-		enum Read { NONE, READ, LOOP_READ, CHECK, UNKNOWN, END };
+		Parent   _parents[Vdi::Job::MAX_PARENTS] { };
+		unsigned _parent_count { 0 };
+		unsigned _parent_init  { 0 };
 
-		struct {
-			enum Write             state;
-			Genode::Vfs::file_size written;
-			Genode::Vfs::file_size max;
-			uint64_t               block_nr;
-			Genode::Vfs::file_size dst_offset;
-			::Block::Operation     operation;
-		} _state_fs { Write::IDLE, 0, 0, 0, 0,
-		              { ::Block::Operation::Type::INVALID, 0, 0}
-		            };
+		Genode::Constructible<Genode::Attached_ram_dataspace> _parent_header { };
+		Genode::Constructible<Genode::Attached_ram_dataspace> _parent_table  { };
+
+		/* header of the current parent is read, its table follows */
+		bool _parent_table_read { false };
+
+		/*
+		 * Flattened lookup of the blocks provided by the parents, built
+		 * once on init, 'image' is the parent index + 1
+		 */
+		enum { CHAIN_ZERO = 0, CHAIN_UNRESOLVED = 0xff };
 
 		struct {
-			enum Read              state;
-			Genode::Vfs::file_size bytes_read;
-			Genode::Vfs::file_size remaining;
-			Genode::Vfs::file_size offset;
-			::Block::Operation     operation;
-			Genode::Vfs::file_size dst_offset;
-		} _state_fs_read { Read::NONE, 0, 0, 0,
-		                   { ::Block::Operation::Type::INVALID, 0, 0},
-		                   0
-		                 };
-
-		enum Sync { IDLING, FAULT, SYNC_QUEUED };
+			uint8_t  * image;
+			uint32_t * block;
+		} _chain { nullptr, nullptr };
+
+		/* bounce buffer to copy parent data into newly allocated blocks */
+		Genode::Constructible<Genode::Attached_ram_dataspace> _copy_buffer { };
+
+		/* image UUID expected for the next parent in the chain */
+		Random_uuid _parent_uuid { };
 
+		bool _init_image();
+		bool _init_parent();
+
+		/* blocks partially discarded recently */
+		enum { DISCARD_SLOTS = 8 };
+
+		Vdi::Discard _discard[DISCARD_SLOTS] { };
+		unsigned     _discard_next { 0 };
+
+		enum Alloc { IDLE, DATA, DONE, ERROR };
+
+		/*
+		 * Only one block allocation at a time, driven by the owning job.
+		 *
+		 * The write payload triggering the allocation becomes part of the
+		 * new block, only the uncovered parts are filled with zeros - or
+		 * are left as hole if the file got extended sparsely.
+		 */
 		struct {
-			enum Sync state;
-		} _state_fs_sync { Sync::IDLING };
+			enum Alloc               state;
+			Vdi::Job               * job;
+			uint64_t                 block_nr;
+			Genode::Vfs::file_size   written;
+			Genode::Vfs::file_size   data_start;
+			Genode::Vfs::file_size   data_end;
+			char const             * data;
+			bool                     hole;
+			unsigned                 parent;        /* copy uncovered parts from */
+			Genode::Vfs::file_offset parent_offset;
+			bool                     copied;        /* chunk read from parent */
+			uint64_t                 started;       /* for the statistics */
+		} _alloc { Alloc::IDLE, nullptr, 0, 0, 0, 0, nullptr, false, 0, 0, false, 0 };
 
 		struct {
 			Genode::Signal_context_capability cap;
 		} _block_notify { };
 
-		static inline constexpr uint32_t sectors_per_block()
+		/*
+		 * Block sessions served concurrently, each client gets a fair
+		 * share of the job slots
+		 */
+		struct Client {
+			Genode::Signal_context_capability cap;
+			bool                              writeable;
+			bool                              retry; /* job slot needed */
+			uint64_t                          retry_since;
+		};
+
+		Client   _clients[MAX_CLIENTS] { };
+		unsigned _client_count { 0 };
+
+		/* wake up init and clients waiting for progress */
+		void _notify()
 		{
-			return HeaderV1Plus::BLOCK_SIZE / HeaderV1Plus::SECTOR_SIZE;
+			if (_block_notify.cap.valid())
+				Genode::Signal_transmitter(_block_notify.cap).submit();
+
+			/* write backs are driven by any client */
+			bool const writeback = _writeback_active();
+
+			for (unsigned i = 0; i < MAX_CLIENTS; i++)
+				if (_clients[i].cap.valid() &&
+				    (_clients[i].retry || writeback || _active(i)))
+					Genode::Signal_transmitter(_clients[i].cap).submit();
+		}
+
+		/*
+		 * The in-memory header and dirty pages of the block table are
+		 * written back on SYNC or when the flush timer triggers
+		 */
+		bool _header_dirty { false };
+		bool _flush_armed  { false };
+
+		bool _dirty_any() const {
+			return _header_dirty || (_table.constructed() && _table->dirty()); }
+
+		void _mark_dirty()
+		{
+			if (_flush_armed || !_timer.constructed())
+				return;
+
+			_timer->trigger_once(_flush_interval.value);
+			_flush_armed = true;
+		}
+
+		enum class Flush { IDLE, DATA, META, SYNC, DONE, ERROR };
+
+		struct {
+			enum Flush               state;
+			Vdi::Job               * job;  /* SYNC job or nullptr if timer triggered */
+			Vdi::Table_cache::Page * page; /* table page currently written back */
+			uint64_t                 started;
+			uint64_t                 seq;  /* completed writes covered */
+			unsigned                 released; /* pending blocks covered */
+		} _flush { Flush::IDLE, nullptr, nullptr, 0, 0, 0 };
+
+		/*
+		 * Writes and discards are counted on completion, a SYNC has
+		 * nothing to do if all writes completed before got flushed
+		 */
+		uint64_t _write_seq  { 0 };
+		uint64_t _synced_seq { 0 };
+
+		Vdi::Io _flush_io { };
+
+		Genode::Microseconds const            _flush_interval;
+		Genode::Constructible<Timer::Connection> _timer { };
+
+		/* I/O signal, the drain on session close waits for the flush */
+		Genode::Io_signal_handler<File> _flush_handler {
+			_env.ep(), *this, &File::_handle_flush };
+
+		void _handle_flush();
+
+		/* a job still reads or writes the released physical block */
+		bool _referenced(uint32_t const pid) const
+		{
+			uint64_t const first = _md->block_offset(pid);
+			uint64_t const end   = first + _md->block_size;
+
+			auto const overlaps = [&] (Vdi::Job const &job) {
+				return job.active() && !job.io.idle() &&
+				       job.io.offset < end && job.io.offset + job.io.size > first; };
+
+			bool referenced = false;
+			_for_each_job([&](Vdi::Job const &job) {
+				if (overlaps(job)) referenced = true; });
+
+			for (auto const &job : _writeback)
+				if (overlaps(job)) referenced = true;
+
+			for (auto const &ra : _readahead)
+				if (overlaps(ra.job)) referenced = true;
+
+			return referenced;
 		}
 
-		static inline uint64_t sector_to_block(uint64_t const nr)
+		void _reuse_released()
+		{
+			_md->reuse([&] (uint32_t const pid) { return _referenced(pid); });
+		}
+
+		void _execute_flush();
+
+		bool _start_flush(Vdi::Job *);
+
+		uint32_t sectors_per_block() const
+		{
+			return _md->sectors_per_block();
+		}
+
+		uint64_t sector_to_block(uint64_t const nr) const
 		{
 			return nr / sectors_per_block();
 		}
 
+		/*
+		 * Look up sector 'nr', 'found' gets the image, 0 for the VDI file
+		 * itself or 1.. for the parents of a differencing image
+		 *
+		 * The table page of the block must be present, see '_present'.
+		 */
 		template <typename BLOCK_MISS, typename BLOCK_READY>
 		auto _apply_block(uint64_t const nr, BLOCK_MISS missing, BLOCK_READY found)
 		{
-			uint32_t const dis = (nr % sectors_per_block()) * HeaderV1Plus::SECTOR_SIZE;
+			uint32_t const dis = (nr % sectors_per_block()) * _md->sector_size;
+			uint32_t const max = _md->block_size - dis;
 			uint32_t const max_bid = _md->max_blocks;
 			uint64_t const bid = sector_to_block(nr);
 
-			if (bid >= max_bid || !_md->table[bid].allocated())
-				return missing(HeaderV1Plus::BLOCK_SIZE - dis);
+			if (bid >= max_bid)
+				return missing(max);
 
-			uint64_t const pid = _md->table[bid].value;
+			Vdi::Block const block = _table->block(bid);
 
-			uint64_t const data = _md->data_offset;
+			if (block.allocated())
+				return found(0u, _md->block_offset(block.value) + dis, max);
 
-			return found(data + (pid * HeaderV1Plus::BLOCK_SIZE) + dis,
-			             HeaderV1Plus::BLOCK_SIZE - dis);
-		}
+			/* free blocks of differencing images are provided by a parent */
+			if (block.free() && _chain.image && _chain.image[bid] != CHAIN_ZERO) {
+				unsigned const image = _chain.image[bid];
+				uint64_t const data  = _parents[image - 1].data_offset;
 
-		void _sync_header(uint64_t const bid)
-		{
-			if (bid >= _md->max_blocks) {
-				Genode::error(__func__, " invalid bid");
-				_state_fs.state = Write::ERROR;
-				return;
+				return found(image, _md->block_offset(_chain.block[bid], data) + dis,
+				             max);
 			}
 
-			HeaderV1Plus *h = (HeaderV1Plus*)(_header_addr + sizeof(Preheader));
-			Vdi::Block *table = (Vdi::Block*)(_header_addr + h->blocks_offset);
-			Genode::Vfs::file_offset const offset = h->blocks_offset + (bid * sizeof (uint32_t));
-
-			if (_state_fs.state == SYNC_HEADER) {
+			return missing(max);
+		}
 
-				h->allocated_blocks = _md->allocated_blocks;
-				table[bid].value     = _md->table[bid].value;
+		template <typename FN>
+		void _for_each_job(FN const &fn)
+		{
+			for (unsigned i = 0; i < _queue_depth; i++)
+				fn(_jobs[i]);
+		}
 
-				/* update block table */
-				_state_fs.written  = 0;
-				_state_fs.max      = sizeof(uint32_t);
+		template <typename FN>
+		void _for_each_job(FN const &fn) const
+		{
+			for (unsigned i = 0; i < _queue_depth; i++)
+				fn(_jobs[i]);
+		}
 
-				_state_fs.state    = SYNC_HEADER_1;
-			}
+		bool _writeback_active() const
+		{
+			for (auto const &job : _writeback)
+				if (job.active()) return true;
+			return false;
+		}
 
-			if (_state_fs.state == SYNC_HEADER_1) {
-				_write(reinterpret_cast<char *>(&table[bid]), sizeof(uint32_t), offset);
+		bool _active() const
+		{
+			bool active = _writeback_active();
+			_for_each_job([&](Vdi::Job const &job) {
+				if (job.active()) active = true; });
 
-				if (_state_fs.written < _state_fs.max)
-					/* will be resumed later, keep state */
-					return;
+			for (auto const &ra : _readahead)
+				if (ra.job.active()) active = true;
 
-				/* update header */
-				_state_fs.written  = 0;
-				_state_fs.max      = HeaderV1Plus::SECTOR_SIZE;
+			return active;
+		}
 
-				_state_fs.state = SYNC_HEADER_2;
-			}
+		/* includes the prefetch, which uses a job handle of the client */
+		bool _active(unsigned const client) const
+		{
+			bool active = _readahead[client].job.active();
+			_for_each_job([&](Vdi::Job const &job) {
+				if (job.active() && job.client == client) active = true; });
+			return active;
+		}
 
-			if (_state_fs.state == SYNC_HEADER_2) {
-				/* update header */
-				_write(reinterpret_cast<char *>(_header_addr),
-				        HeaderV1Plus::SECTOR_SIZE, 0 /*offset*/);
+		/* the SYNC barrier applies to the requests of its client */
+		bool _active_before_sync(unsigned const client) const
+		{
+			bool active = false;
+			_for_each_job([&](Vdi::Job const &job) {
+				if (job.active() && job.client == client &&
+				    !job.type(::Block::Operation::Type::SYNC))
+					active = true; });
+			return active;
+		}
 
-				if (_state_fs.written < _state_fs.max)
-					/* will be resumed later, keep state */
-					return;
+		bool _sync_pending(unsigned const client) const
+		{
+			bool pending = false;
+			_for_each_job([&](Vdi::Job const &job) {
+				if (job.active() && job.client == client &&
+				    job.type(::Block::Operation::Type::SYNC))
+					pending = true; });
+			return pending;
+		}
 
-				_state_fs.state = Write::SYNC_OK;
-			}
+		unsigned _jobs_of(unsigned const client) const
+		{
+			unsigned count = 0;
+			_for_each_job([&](Vdi::Job const &job) {
+				if (!job.free() && job.client == client) count++; });
+			return count;
 		}
 
-		void _allocate_block(uint64_t nr)
+		Genode::Vfs::Vfs_handle *_open(Genode::String<256> const &file,
+		                               bool const writeable)
 		{
-			if (_md->allocated_blocks >= _md->max_blocks) {
-				Genode::error("allocated blocks > max blocks");
-				_state_fs.state = Write::ERROR;
-				return;
-			}
+			Genode::Vfs::Vfs_handle *handle = nullptr;
 
-			if (_state_fs.state != Write::IDLE) {
-				Genode::error("several allocate block requests");
-				_state_fs.state = Write::ERROR;
-				return;
+			Genode::Vfs::Directory_service::Open_result open_result =
+			_vfs_env.root_dir().open(file.string(),
+			                         writeable ? Genode::Vfs::Directory_service::OPEN_MODE_RDWR
+			                                   : Genode::Vfs::Directory_service::OPEN_MODE_RDONLY,
+			                         &handle, _heap);
+			if (open_result != Genode::Vfs::Directory_service::OPEN_OK) {
+				Genode::error("Could not open '", file, "'");
+				throw Could_not_open_file();
 			}
 
-			_state_fs.state    = Write::ALLOC_BLOCK;
-			_state_fs.written  = 0;
-			_state_fs.max      = _md->block_size;
-			_state_fs.block_nr = nr;
+			handle->handler(this);
 
-			_execute_alloc_block();
+			return handle;
 		}
 
-		Genode::Vfs::File_io_service::Sync_result _complete_sync_fs() {
-			return _vdi_file->fs().complete_sync(_vdi_file); }
-
-		void _write(char * const base, Genode::Vfs::file_size const base_size,
-		            Genode::uint64_t const fs_offset)
+		Vdi::Io::Result _write(Genode::Vfs::Vfs_handle &handle, Vdi::Io &io,
+		                       char const * const src)
 		{
-			auto const written_state_on_enter = _state_fs.written;
+			auto const written_on_enter = io.done;
 
-			do {
-				if (_state_fs.written > _state_fs.max ||
-				    _state_fs.written > base_size) {
-					Genode::error("size errors");
-					_state_fs.state = Write::ERROR;
-					break;
-				}
+			Vdi::Io::Result result = Vdi::Io::DONE;
 
-				auto rest = Genode::min(base_size - _state_fs.written,
-				                        _state_fs.max - _state_fs.written);
-				char * dst = base + _state_fs.written;
+			while (io.done < io.size) {
 				Genode::size_t written = 0;
 
-				_vdi_file->seek(fs_offset + _state_fs.written);
+				handle.seek(io.offset + io.done);
 
-				auto const range = Genode::Const_byte_range_ptr(dst, rest);
-				auto const res = _vdi_file->fs().write(_vdi_file, range,
-				                                       written);
+				auto const range = Genode::Const_byte_range_ptr(src + io.done,
+				                                                Genode::size_t(io.size - io.done));
+				auto const res = handle.fs().write(&handle, range, written);
 
 				if (res == Genode::Vfs::File_io_service::WRITE_ERR_WOULD_BLOCK) {
 					if (written != 0)
 						Genode::warning("WOULD_ERR_WOULD_BLOCK but written is not 0 -> ", written);
 					/* will be resumed later, keep state on WRITE */
+					result = Vdi::Io::PENDING;
 					break;
 				}
 
 				if (res != Genode::Vfs::File_io_service::WRITE_OK) {
-					_state_fs.state = Write::ERROR;
 					Genode::error(".... write error");
+					result = Vdi::Io::ERROR;
 					break;
 				}
 
-				_state_fs.written += written;
-			} while (_state_fs.written < _state_fs.max);
+				if (!written) {
+					result = Vdi::Io::PENDING;
+					break;
+				}
 
-			if (_state_fs.written != written_state_on_enter) {
+				io.done += written;
+			}
+
+			if (io.done != written_on_enter) {
 				/* trigger queued write operations to be processed */
 				_vfs_env.io().commit();
 			}
-		}
 
-		void _read(char * dst, Genode::Vfs::file_size const dst_size)
-		{
-			Genode::Vfs::Vfs_handle &handle = *_vdi_file;
+			if (result != Vdi::Io::PENDING)
+				io.state = Vdi::Io::IDLE;
 
-			if (_state_fs_read.state == Read::LOOP_READ)
-				_state_fs_read.state = Read::READ;
+			return result;
+		}
 
-			if (_state_fs_read.state == Read::READ) {
-				handle.seek(_state_fs_read.offset);
+		Vdi::Io::Result _read(Genode::Vfs::Vfs_handle &handle, Vdi::Io &io,
+		                      char * const dst)
+		{
+			while (io.done < io.size) {
 
-				if (!handle.fs().queue_read(&handle, _state_fs_read.remaining)) {
-					/* will be resumed later, keep READ state */
-					return;
-				}
+				if (io.state == Vdi::Io::READ) {
+					handle.seek(io.offset + io.done);
 
-				_state_fs_read.state = Read::CHECK;
+					if (!handle.fs().queue_read(&handle, Genode::size_t(io.size - io.done)))
+						/* will be resumed later, keep READ state */
+						return Vdi::Io::PENDING;
 
-				/* trigger queued read to be processed */
-				_vfs_env.io().commit();
-			}
+					io.state = Vdi::Io::READ_QUEUED;
 
-			if (_state_fs_read.state == Read::CHECK) {
-				if (_state_fs_read.remaining > dst_size) {
-					Genode::error("buffer insufficient to read data");
-					_state_fs_read.state = Read::UNKNOWN;
-					return;
+					/* trigger queued read to be processed */
+					_vfs_env.io().commit();
 				}
 
-				char          *p = dst + _state_fs_read.bytes_read;
 				Genode::size_t n = 0;
 
-				auto const range = Genode::Byte_range_ptr(p, _state_fs_read.remaining);
+				auto const range = Genode::Byte_range_ptr(dst + io.done,
+				                                          Genode::size_t(io.size - io.done));
 
-				Read_result read_result =
+				Read_result const read_result =
 					handle.fs().complete_read(&handle, range, n);
 
-				switch (read_result) {
-				case Genode::Vfs::File_io_service::READ_OK:
-				{
-					if (_state_fs_read.remaining != n) {
-						if (n)
-							_state_fs_read.state = Read::LOOP_READ;
-						else {
-							/* end of file */
-							_state_fs_read.state = Read::END;
-						}
-					}
-
-					_state_fs_read.bytes_read += n;
-					_state_fs_read.offset     += n;
-
-					if (_state_fs_read.remaining >= n)
-						_state_fs_read.remaining  -= n;
-					else
-						_state_fs_read.remaining = 0;
-
-					if (_state_fs_read.remaining == 0)
-						_state_fs_read.state = Read::NONE;
-
-					break;
-				}
-				case Genode::Vfs::File_io_service::READ_QUEUED:
+				if (read_result == Genode::Vfs::File_io_service::READ_QUEUED) {
 					if (n)
 						Genode::error("read queued with n=", n);
-					break;
-				default:
+					return Vdi::Io::PENDING;
+				}
+
+				if (read_result != Genode::Vfs::File_io_service::READ_OK) {
 					Genode::error("read not ok res=", (int)read_result, " ", n);
+					io.state = Vdi::Io::IDLE;
+					return Vdi::Io::ERROR;
+				}
+
+				if (!n) {
+					/* end of file */
+					io.state = Vdi::Io::IDLE;
+					return Vdi::Io::END;
 				}
+
+				io.done += n;
+
+				/* read the rest, if any */
+				io.state = Vdi::Io::READ;
 			}
-		}
 
-		typedef ::Block::Request_stream::Response Response;
+			io.state = Vdi::Io::IDLE;
+			return Vdi::Io::DONE;
+		}
 
-		Response _sync()
+		Vdi::Io::Result _sync(Genode::Vfs::Vfs_handle &handle, Vdi::Io &io)
 		{
-			switch (_state_fs_sync.state) {
-			case Sync::FAULT:
-				return Response::REJECTED;
+			if (io.state == Vdi::Io::SYNC) {
+				if (!handle.fs().queue_sync(&handle))
+					return Vdi::Io::PENDING;
 
-			case Sync::IDLING:
-				if (!_vdi_file->fs().queue_sync(_vdi_file))
-					return Response::RETRY;
-				_state_fs_sync.state = Sync::SYNC_QUEUED;
+				io.state = Vdi::Io::SYNC_QUEUED;
 
 				/* trigger queued sync to be processed */
 				_vfs_env.io().commit();
+			}
 
-				[[fallthrough]];
-
-			case Sync::SYNC_QUEUED: {
-				Sync_result res = _complete_sync_fs();
-				switch (res) {
-				case Genode::Vfs::File_io_service::SYNC_QUEUED:
-					_state_fs_sync.state = Sync::SYNC_QUEUED;
-					return Response::RETRY;
-				case Genode::Vfs::File_io_service::SYNC_ERR_INVALID:
-					Genode::error("sync fault - out of service");
-					_state_fs_sync.state = Sync::FAULT;
-					return Response::REJECTED;
-				case Genode::Vfs::File_io_service::SYNC_OK:
-					_state_fs_sync.state = Sync::IDLING;
-					return Response::ACCEPTED;
-				}
+			Sync_result const res = handle.fs().complete_sync(&handle);
+
+			switch (res) {
+			case Genode::Vfs::File_io_service::SYNC_QUEUED:
+				return Vdi::Io::PENDING;
+			case Genode::Vfs::File_io_service::SYNC_ERR_INVALID:
+				io.state = Vdi::Io::IDLE;
+				return Vdi::Io::ERROR;
+			case Genode::Vfs::File_io_service::SYNC_OK:
+				break;
+			}
+
+			io.state = Vdi::Io::IDLE;
+			return Vdi::Io::DONE;
+		}
+
+		/*
+		 * Extend file by a hole of zeros, which avoids writing zeros
+		 */
+		bool _extend_sparse(Genode::Vfs::Vfs_handle &handle,
+		                    Genode::Vfs::file_offset const offset,
+		                    Genode::Vfs::file_size   const size)
+		{
+			if (!_sparse)
+				return false;
+
+			/* block within the extent reserved by a previous extension */
+			if (offset >= _reserved && offset + size <= _file_size) {
+				_reserved = offset + size;
+				return true;
+			}
+
+			if (offset < _file_size)
+				return false;
+
+			/* consecutive blocks are separated by 'block_extra' bytes */
+			Genode::Vfs::file_size const stride = size + _md->block_extra;
+
+			Genode::Vfs::file_size const end =
+				Genode::max(offset + size,
+				            Genode::min(offset + stride * (_preallocate - 1) + size,
+				                        Genode::Vfs::file_size(_md->block_offset(_md->max_blocks) -
+				                                               _md->block_extra)));
+
+			auto const res = handle.fs().ftruncate(&handle, end);
+			if (res != Genode::Vfs::File_io_service::FTRUNCATE_OK) {
+				Genode::log("no sparse file support, fill blocks with zeros");
+				_sparse = false;
+				return false;
 			}
+
+			_file_size = end;
+			_reserved  = offset + size;
+			return true;
+		}
+
+		void _execute_alloc_block();
+
+		bool _allocate_block(Vdi::Job &, uint64_t, char const *,
+		                     Genode::Vfs::file_size, unsigned,
+		                     Genode::Vfs::file_offset, bool &);
+
+		/*
+		 * Position of the job data in the file, used to order jobs. Blocks
+		 * to be allocated are appended to the file and are ordered last.
+		 */
+		uint64_t _file_offset(Vdi::Job const &job)
+		{
+			using Type = ::Block::Operation::Type;
+
+			if (!job.type(Type::READ) && !job.type(Type::WRITE))
+				return ~0ull;
+
+			uint64_t const nr = job.request.operation.block_number;
+
+			if (_fixed)
+				return _md->data_offset + nr * _block_ops.block_size;
+
+			uint64_t const bid = sector_to_block(nr);
+
+			if (!_table->present(bid) || bid >= _md->max_blocks)
+				return nr * _block_ops.block_size;
+
+			Vdi::Block const block = _table->block(bid);
+
+			return block.allocated()
+			       ? _md->block_offset(block.value) +
+			         (nr % sectors_per_block()) * _md->sector_size
+			       : ~0ull;
+		}
+
+		bool _execute_io(Vdi::Job &job, char * const buffer) {
+			return _fixed ? _execute_fixed(job, buffer) : _execute_rw(job, buffer); }
+
+		bool _execute_rw(Vdi::Job &, char *);
+
+		Genode::Vfs::file_size _contiguous(uint64_t, unsigned, Genode::Vfs::file_size);
+
+		/* preallocated image with linear block mapping */
+		bool _fixed { false };
+
+		bool _linear(Vdi::Table_cache::Page const &page)
+		{
+			uint64_t const first = page.index * Vdi::Table_cache::ENTRIES;
+			uint64_t const end   = Genode::min(first + Vdi::Table_cache::ENTRIES,
+			                                   uint64_t(_md->max_blocks));
+
+			for (uint64_t bid = first; bid < end; bid++)
+				if (_table->block(bid).value != bid)
+					return false;
+
+			return true;
+		}
+
+		bool _execute_fixed(Vdi::Job &, char *);
+
+		/*
+		 * Volatile overlay in RAM, which takes all writes, the image is
+		 * opened read-only and never modified
+		 */
+		bool           const _overlay_ram;
+		Genode::size_t const _overlay_limit;
+
+		Genode::Constructible<Vdi::Overlay> _overlay { };
+
+		bool _execute_overlay(Vdi::Job &, char *);
+
+		void _overlay_merge(Vdi::Job const &, char *);
+
+		void _overlay_discard(::Block::Operation const &);
+
+		/*
+		 * Optional write-back cache of the disk content, written back on
+		 * SYNC or if no clean page is left
+		 */
+		enum { WRITEBACK_JOBS = 4 };
+
+		Genode::size_t const               _cache_budget;
+		Genode::Constructible<Vdi::Cache>  _cache { };
+		Vdi::Job                           _writeback[WRITEBACK_JOBS] { };
+
+		Genode::Constructible<Genode::Expanding_reporter> _cache_reporter { };
+
+		bool _execute_cached(Vdi::Job &, char *);
+
+		bool _cache_write(Vdi::Job &, char const *);
+
+		void _cache_fill(Vdi::Job &, char *);
+
+		void _cache_writeback();
+
+		bool _execute_writeback();
+
+		void _cache_invalidate(uint64_t, uint64_t);
+
+		void _cache_report();
+
+		bool _cache_clean() const {
+			return !_cache.constructed() || (!_cache->dirty_pages() && !_writeback_active()); }
+
+		/*
+		 * Read-ahead for sequential streams of each client, the window
+		 * grows while prefetched data is used and shrinks if it is not
+		 */
+		enum { READAHEAD_MIN = 64u << 10, READAHEAD_STREAM = 2 };
+
+		Genode::size_t const _readahead_max;
+		Vdi::Readahead       _readahead[MAX_CLIENTS] { };
+
+		struct {
+			uint64_t hits;
+			uint64_t misses;
+			uint64_t streams;
+		} _readahead_stats { 0, 0, 0 };
+
+		Genode::Constructible<Genode::Expanding_reporter> _readahead_reporter { };
+
+		Genode::size_t _readahead_initial() const {
+			return Genode::min(Genode::size_t(READAHEAD_MIN), _readahead_max); }
+
+		enum class Prefetched { HIT, MISS, WAIT };
+
+		void _readahead_track(unsigned, ::Block::Request const &);
+
+		Prefetched _readahead_lookup(Vdi::Job &);
+
+		void _readahead_start(unsigned, uint64_t);
+
+		bool _execute_readahead(unsigned);
+
+		void _readahead_invalidate(::Block::Operation const &);
+
+		void _readahead_report();
+
+		/*
+		 * Optional statistics, reported periodically
+		 */
+		Genode::Microseconds const                        _stats_interval;
+		Genode::Constructible<Timer::Connection>          _stats_timer    { };
+		Genode::Constructible<Genode::Expanding_reporter> _stats_reporter { };
+
+		Vdi::Stats _stats { };
+
+		Genode::Signal_handler<File> _stats_handler {
+			_env.ep(), *this, &File::_stats_report };
+
+		void _stats_report();
+
+		uint64_t _now() {
+			return _stats_timer.constructed() ? _stats_timer->elapsed_us() : 0; }
+
+		void _stats_acked(::Block::Request const &, uint64_t, uint64_t);
+
+		Response _retry(unsigned const client)
+		{
+			if (_stats_timer.constructed()) {
+				_stats.retries ++;
+
+				if (!_clients[client].retry_since)
+					_clients[client].retry_since = _now();
 			}
-			return Response::REJECTED;
+
+			return Response::RETRY;
+		}
+
+		/* requests waiting for a job slot count from their first attempt */
+		uint64_t _submitted(unsigned const client)
+		{
+			if (!_stats_timer.constructed())
+				return 0;
+
+			uint64_t const since = _clients[client].retry_since;
+			_clients[client].retry_since = 0;
+
+			return since ? since : _now();
 		}
 
-		Response _read_split(::Block::Operation const operation,
-		                     void * dst, Genode::Vfs::file_size,
-		                     uint64_t const file_offset,
-		                     uint32_t const max_offset_read);
+		bool _execute_sync(Vdi::Job &);
 
-		bool _cross_vdi_block(::Block::Operation const) const;
+		bool _execute_trim(Vdi::Job &);
 
-		Vdi::File::Response _vdi_read(::Block::Request const &,
-		                              ::Block::Request_stream::Payload const &);
+		void _discard_block(uint64_t);
 
-		Vdi::File::Response _vdi_write(::Block::Request const &,
-		                               ::Block::Request_stream::Payload const &);
+		void _discard_partial(uint64_t, unsigned, unsigned);
+
+		void _discard_invalidate(uint64_t const bid)
+		{
+			for (auto &d : _discard)
+				if (d.bid == bid) d.invalidate();
+		}
 
 	public:
 
 		struct Could_not_open_file : Genode::Exception { };
 
+		static constexpr unsigned max_clients() { return MAX_CLIENTS; }
+
 		File(Genode::Env &env, Genode::Node const &config)
 		:
 			_env(env), _vfs_env(config.with_sub_node("vfs",
@@ -558,11 +1133,53 @@ class Vdi::File: Genode::Vfs::Read_ready_response_handler, Genode::Vfs::Env::Use
 				[&] () -> Genode::Vfs::Simple_env {
 					Genode::error("VFS not configured");
 					return { _env, _heap, { } };
-			}))
+			})),
+			_table_budget(config.attribute_value("table_cache",
+			                                     Genode::Number_of_bytes(1u << 20))),
+			_queue_depth(Genode::max(1u, Genode::min(config.attribute_value("queue_depth", 4u),
+			                                         unsigned(MAX_QUEUE_DEPTH)))),
+			_preallocate(Genode::max(1u, config.attribute_value("preallocate", 1u))),
+			_flush_interval(config.attribute_value("flush_interval_ms", 0ull) * 1000),
+			_overlay_ram(config.attribute_value("overlay", Genode::String<8>()) == "ram"),
+			_overlay_limit(config.attribute_value("overlay_limit",
+			                                      Genode::Number_of_bytes(64u << 20))),
+			_cache_budget(_overlay_ram ? 0
+			              : Genode::size_t(config.attribute_value("cache",
+			                                                      Genode::Number_of_bytes(0)))),
+			_readahead_max(_cache_budget ? 0
+			               : Genode::size_t(config.attribute_value("readahead",
+			                                                       Genode::Number_of_bytes(0)))),
+			_stats_interval(config.attribute_value("stats_interval_ms", 0ull) * 1000)
 		{
-			bool const writeable = config.attribute_value("writeable", false);
+			if (_stats_interval.value) {
+				_stats_reporter.construct(_env, "vdi_stats", "vdi_stats");
+				_stats_timer.construct(_env);
+				_stats_timer->sigh(_stats_handler);
+				_stats_timer->trigger_periodic(_stats_interval.value);
+			}
+
+			if (_cache_budget && config.attribute_value("report_cache", false))
+				_cache_reporter.construct(_env, "cache", "cache");
+
+			if (_cache_budget && config.has_attribute("readahead"))
+				Genode::warning("read-ahead disabled in favour of the cache");
+
+			if (_readahead_max && config.attribute_value("report_readahead", false))
+				_readahead_reporter.construct(_env, "readahead", "readahead");
+
+			if (_flush_interval.value) {
+				_timer.construct(_env);
+				_timer->sigh(_flush_handler);
+			}
+
+			if (_overlay_ram && config.has_attribute("cache"))
+				Genode::warning("cache disabled in favour of the overlay");
 
-			_block_ops.writeable = writeable;
+			/* the overlay makes read-only images writeable */
+			bool const writeable = config.attribute_value("writeable", false) &&
+			                       !_overlay_ram;
+
+			_block_ops.writeable = writeable || _overlay_ram;
 
 			Genode::String<256> file;
 			file = config.attribute_value("file", file);
@@ -570,20 +1187,64 @@ class Vdi::File: Genode::Vfs::Read_ready_response_handler, Genode::Vfs::Env::Use
 				Genode::error("mandatory file attribute missing");
 				throw Could_not_open_file();
 			}
-			Genode::Vfs::Directory_service::Open_result open_result =
-			_vfs_env.root_dir().open(file.string(),
-			                         writeable ? Genode::Vfs::Directory_service::OPEN_MODE_RDWR
-			                                   : Genode::Vfs::Directory_service::OPEN_MODE_RDONLY,
-			                         &_vdi_file, _heap);
-			if (open_result != Genode::Vfs::Directory_service::OPEN_OK) {
-				Genode::error("Could not open '", file, "'");
-				throw Could_not_open_file();
+
+			/* handle for metadata, each job gets its own handle for data */
+			_vdi_file   = _open(file, writeable);
+			_table_file = _open(file, false);
+
+			config.for_each_sub_node("parent", [&] (Genode::Node const &node) {
+				if (_parent_count >= Vdi::Job::MAX_PARENTS) {
+					Genode::error("too many parent images");
+					throw Could_not_open_file();
+				}
+
+				Parent &parent = _parents[_parent_count++];
+				parent.file   = node.attribute_value("file", Genode::String<256>());
+				parent.handle = _open(parent.file, false);
+			});
+
+			/*
+			 * Each job has a handle per image of the chain, long chains
+			 * reduce the queue depth to bound the number of handles
+			 */
+			unsigned const images = 1 + _parent_count;
+			unsigned const extra  = (_cache_budget  ? unsigned(WRITEBACK_JOBS) : 0) +
+			                        (_readahead_max ? unsigned(MAX_CLIENTS)    : 0);
+			unsigned const used   = 2 + _parent_count + extra * images;
+			unsigned const depth  = used < MAX_HANDLES ? (MAX_HANDLES - used) / images : 0;
+
+			if (_queue_depth > Genode::max(depth, 1u)) {
+				_queue_depth = Genode::max(depth, 1u);
+				Genode::warning("queue depth limited to ", _queue_depth,
+				                " for ", images, " images");
 			}
 
-			_vdi_file->handler(this);
+			auto const open_job = [&] (Vdi::Job &job) {
+				job.handle = _open(file, writeable);
+
+				for (unsigned i = 0; i < _parent_count; i++)
+					job.parent[i] = _open(_parents[i].file, false);
+			};
+
+			_for_each_job(open_job);
+
+			if (_cache_budget)
+				for (auto &job : _writeback) open_job(job);
+
+			if (_readahead_max)
+				for (auto &ra : _readahead) open_job(ra.job);
+
+			Genode::Vfs::Directory_service::Stat stat { };
+			if (_vfs_env.root_dir().stat(file.string(), stat) ==
+			    Genode::Vfs::Directory_service::STAT_OK)
+				_file_size = _reserved = stat.size;
+			else
+				_sparse = false;
 
 			Genode::log("Provide '", file.string(), "' as block device,"
-			            " writeable: ", writeable ? "yes" : "no");
+			            " writeable: ", _block_ops.writeable ? "yes" : "no",
+			            _overlay_ram ? " (RAM overlay)" : "",
+			            " queue depth: ", _queue_depth);
 		}
 
 		void set_notify_cap(Genode::Signal_context_capability const signal) {
@@ -591,67 +1252,51 @@ class Vdi::File: Genode::Vfs::Read_ready_response_handler, Genode::Vfs::Env::Use
 
 		bool init(Genode::Signal_context_capability const init_signal)
 		{
-			if (_state_fs_read.bytes_read != _header_size) {
-				if (_state_fs_read.state == Read::NONE) {
-					set_notify_cap(init_signal);
+			if (_init == Init::NONE) {
+				set_notify_cap(init_signal);
 
-					_state_fs_read.bytes_read = 0;
-					_state_fs_read.remaining  = _header_size;
-					_state_fs_read.offset     = 0;
-					_state_fs_read.state      = Read::READ;
-				}
-
-				do {
-					_read(_header_addr, _header_size);
-				} while (_state_fs_read.state == Read::LOOP_READ);
+				_init_io.read(0, _header_size);
+				_init = Init::READ;
+			}
 
-				if (_state_fs_read.state == Read::END) {
-					if (_state_fs_read.bytes_read >= sizeof(Preheader) + sizeof(HeaderV1Plus)) {
-						_state_fs_read.state = Read::NONE;
-						_header_size = _state_fs_read.bytes_read;
-					} else {
-						_state_fs_read.state = Read::UNKNOWN;
+			if (_init == Init::READ) {
+				switch (_read(*_vdi_file, _init_io, _header_addr)) {
+				case Vdi::Io::PENDING:
+					return false;
+				case Vdi::Io::ERROR:
+					Genode::error("read header failed");
+					_init = Init::FAILED;
+					return false;
+				case Vdi::Io::END:
+					if (_init_io.done < sizeof(Preheader) + sizeof(HeaderV1Plus)) {
 						Genode::error("read header to short");
+						_init = Init::FAILED;
+						return false;
 					}
+					_header_size = _init_io.done;
+					break;
+				case Vdi::Io::DONE:
+					break;
 				}
-			}
-
-			if (_state_fs_read.state != Read::NONE ||
-			    _state_fs_read.bytes_read != _header_size)
-				return false;
-
-			set_notify_cap(Genode::Signal_context_capability());
-
-			Preheader    const &ph = *(Preheader*)(_header_addr);
-			HeaderV1Plus const  &h = *(HeaderV1Plus*)(_header_addr + sizeof(Preheader));
 
-			print_headers(ph, h);
+				if (!_init_image()) {
+					_init = Init::FAILED;
+					return false;
+				}
 
-			if (!ph.valid()) {
-				_state_fs_read.state = Read::UNKNOWN;
-				Genode::error("signature error");
-				return false;
+				_init = Init::PARENT;
 			}
 
-			if (h.blocks_offset + h.blocks * sizeof(Vdi::Block::value) > _state_fs_read.bytes_read) {
-				Genode::error("block count error");
-				_state_fs_read.state = Read::UNKNOWN;
-				return false;
-			}
+			if (_init == Init::PARENT) {
+				if (!_init_parent())
+					return false;
 
-			_md.construct(h.blocks_offset, h.data_offset,
-			              HeaderV1Plus::BLOCK_SIZE, HeaderV1Plus::SECTOR_SIZE);
-			_md->max_blocks       = h.blocks;
-			_md->allocated_blocks = h.allocated_blocks;
-			_md->table            = (Vdi::Block*)(_header_addr + h.blocks_offset);
+				_init = Init::DONE;
 
-			_block_ops.block_size = HeaderV1Plus::SECTOR_SIZE;
-			_block_ops.block_count = h.disk_size / _block_ops.block_size;
-
-			Genode::log("block_size: ", uint64_t(_block_ops.block_size),
-			            " block_count: ", uint64_t(_block_ops.block_count));
+				set_notify_cap(Genode::Signal_context_capability());
+			}
 
-			return true;
+			return _init == Init::DONE;
 		}
 
 		~File()
@@ -661,36 +1306,246 @@ class Vdi::File: Genode::Vfs::Read_ready_response_handler, Genode::Vfs::Env::Use
 
 		::Block::Session::Info info() const { return _block_ops; }
 
-		Response handle(::Block::Request const & request,
-		                ::Block::Request_stream::Payload const &payload)
+		void open_client(unsigned const client, Genode::Signal_context_capability const cap,
+		                 bool const writeable)
 		{
-			Response response { Response::REJECTED };
+			_clients[client] = { cap, writeable && _block_ops.writeable, false, 0 };
+			_client_count ++;
 
-			if (_state_fs.state      == Write::ERROR ||
-			    _state_fs_read.state == Read::UNKNOWN ||
-			    _state_fs_sync.state == Sync::FAULT)
-				return response;
+			_readahead[client].reset(_readahead_initial());
+		}
 
-			switch (request.operation.type) {
-			case ::Block::Operation::Type::READ:
-				response = _vdi_read(request, payload);
-				break;
-			case ::Block::Operation::Type::WRITE:
-				response = _vdi_write(request, payload);
-				break;
-			case ::Block::Operation::Type::SYNC:
-				response = _sync();
+		void close_client(unsigned const client)
+		{
+			_clients[client] = { };
+			_client_count --;
+
+			_readahead[client].reset(0);
+
+			/* the share of the job slots of the others grows */
+			_notify();
+		}
+
+		/**
+		 * Queue request as job, RETRY if no job slot is available
+		 *
+		 * The payload 'buffer' of READ and WRITE requests must stay valid
+		 * until the job is completed.
+		 */
+		Response submit(unsigned const client, ::Block::Request const &request,
+		                char * const buffer)
+		{
+			using Type = ::Block::Operation::Type;
+
+			if (_fault)
+				return Response::REJECTED;
+
+			Type const type = request.operation.type;
+
+			if (type != Type::READ && type != Type::WRITE &&
+			    type != Type::SYNC && type != Type::TRIM) {
+				Genode::warning("unsupported command ", (int)type, " ",
+				                type == Type::INVALID ? " invalid" : " unknown");
+				return Response::REJECTED;
+			}
+
+			if ((type == Type::WRITE || type == Type::TRIM) && !_clients[client].writeable)
+				return Response::REJECTED;
+
+			/* a SYNC is a barrier, keep further requests until it is done */
+			if (_sync_pending(client))
+				return _retry(client);
+
+			/* adjacent reads and writes are merged into one pending job */
+			if (type == Type::READ || type == Type::WRITE) {
+				Vdi::Job *merged = nullptr;
+
+				_for_each_job([&](Vdi::Job &job) {
+					if (!merged && job.client == client &&
+					    job.mergeable(request, buffer, _block_ops.block_size, MAX_MERGE))
+						merged = &job;
+				});
+
+				if (merged) {
+					merged->merge(request);
+					merged->part_time[merged->part_count - 1] = _submitted(client);
+
+					if (type == Type::READ && _readahead_max)
+						_readahead_track(client, request);
+
+					return Response::ACCEPTED;
+				}
+			}
+
+			/* fair share of the job slots */
+			unsigned const share = Genode::max(1u, _queue_depth /
+			                                       Genode::max(1u, _client_count));
+
+			Response response = Response::RETRY;
+
+			for (unsigned i = 0; i < _queue_depth && _jobs_of(client) < share; i++) {
+				if (!_jobs[i].free())
+					continue;
+
+				_jobs[i].submit(request, buffer);
+				_jobs[i].client       = client;
+				_jobs[i].part_time[0] = _submitted(client);
+				response = Response::ACCEPTED;
 				break;
-			default:
-				Genode::warning("unsupported command ",
-				                (int)(request.operation.type), " ",
-				                request.operation.type == ::Block::Operation::Type::TRIM ? " trim" :
-				                request.operation.type == ::Block::Operation::Type::INVALID ? " invalid" : " unknown");
+			}
+
+			_clients[client].retry = response == Response::RETRY;
+
+			if (response == Response::RETRY)
+				return _retry(client);
+
+			if (response == Response::ACCEPTED && type == Type::READ && _readahead_max)
+				_readahead_track(client, request);
+
+			return response;
+		}
+
+		/**
+		 * Drive all queued jobs of the client as far as possible
+		 *
+		 * \return true if any job made progress
+		 */
+		bool execute(unsigned const client)
+		{
+			bool progress = _execute_page_in();
+
+			if (_execute_writeback())
+				progress = true;
+
+			if (_execute_readahead(client))
+				progress = true;
+
+			/* start and drive jobs in the order of their file offset */
+			Vdi::Job *order[MAX_QUEUE_DEPTH];
+			uint64_t  key  [MAX_QUEUE_DEPTH];
+			unsigned  count = 0;
+
+			_for_each_job([&](Vdi::Job &job) {
+				if (!job.active() || job.client != client)
+					return;
+
+				uint64_t const k = _file_offset(job);
+
+				unsigned i = count++;
+				for (; i > 0 && key[i - 1] > k; i--) {
+					order[i] = order[i - 1];
+					key  [i] = key  [i - 1];
+				}
+				order[i] = &job;
+				key  [i] = k;
+			});
+
+			for (unsigned i = 0; i < count; i++) {
+				Vdi::Job &job = *order[i];
+
+				if (job.state == Vdi::Job::PENDING) {
+					/* SYNC waits for all requests received before */
+					if (job.type(::Block::Operation::Type::SYNC) &&
+					    _active_before_sync(client))
+						continue;
+
+					if (job.type(::Block::Operation::Type::SYNC))
+						job.seq = _write_seq;
+
+					if (job.type(::Block::Operation::Type::READ) && _readahead_max) {
+						Prefetched const prefetched = _readahead_lookup(job);
+
+						if (prefetched == Prefetched::WAIT)
+							continue;
+
+						if (prefetched == Prefetched::HIT) {
+							progress = true;
+							continue;
+						}
+					}
+
+					job.state = Vdi::Job::IN_PROGRESS;
+					progress  = true;
+				}
+
+				if (job.type(::Block::Operation::Type::SYNC)) {
+					if (_execute_sync(job))
+						progress = true;
+				} else
+				if (job.type(::Block::Operation::Type::TRIM)) {
+					if (_execute_trim(job))
+						progress = true;
+				} else
+				if (_overlay.constructed()) {
+					if (_execute_overlay(job, job.buffer))
+						progress = true;
+				} else
+				if (_cache.constructed()) {
+					if (_execute_cached(job, job.buffer))
+						progress = true;
+				} else
+					if (_execute_io(job, job.buffer))
+						progress = true;
+
+				bool const modified = job.complete() &&
+				                      (job.type(::Block::Operation::Type::WRITE) ||
+				                       job.type(::Block::Operation::Type::TRIM));
+				if (modified)
+					_write_seq ++;
+
+				/* prefetched data is outdated by writes and discards */
+				if (modified && _readahead_max)
+					_readahead_invalidate(job.request.operation);
 			}
 
 			/* artifical ? */
 			_vfs_env.io().commit();
 
-			return response;
+			return progress;
 		}
+
+		/**
+		 * Apply 'fn' to the requests of completed jobs of the client, the
+		 * job is freed if 'fn' returns true for all its requests
+		 */
+		template <typename FN>
+		void with_completed(unsigned const client, FN const &fn)
+		{
+			bool     released = false;
+			uint64_t now      = 0;
+
+			_for_each_job([&](Vdi::Job &job) {
+				if (job.client != client || !job.complete())
+					return;
+
+				for (; job.part_acked < job.part_count; job.part_acked++) {
+					::Block::Request part = job.parts[job.part_acked];
+					part.success = job.request.success;
+
+					if (!fn(part))
+						return;
+
+					if (!_stats_timer.constructed() || !part.success)
+						continue;
+
+					if (!now)
+						now = _now();
+
+					_stats_acked(part, job.part_time[job.part_acked], now);
+				}
+
+				job.release();
+				released = true;
+			});
+
+			/* clients waiting for a job slot may continue */
+			if (!released)
+				return;
+
+			for (unsigned i = 0; i < MAX_CLIENTS; i++)
+				if (i != client && _clients[i].retry && _clients[i].cap.valid())
+					Genode::Signal_transmitter(_clients[i].cap).submit();
+		}
+
+		bool jobs_active(unsigned const client) const { return _active(client); }
 };
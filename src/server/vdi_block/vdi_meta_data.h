@@ -0,0 +1,201 @@
+/*
+ * \brief  Metadata of a VDI file
+ * \author Josef Soentgen
+ * \author Alexander Boettcher
+ * \date   2018-11-01
+ */
+
+/*
+ * Copyright (C) 2018-2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#pragma once
+
+/* Genode includes */
+#include <util/misc_math.h>
+
+/* local includes */
+#include <vdi_table.h>
+#include <vdi_types.h>
+
+namespace Vdi {
+	struct Meta_data;
+
+	static inline bool zero_data(char const *, uint64_t);
+}
+
+
+/*
+ * Word-wise check in chunks, the inner loop is vectorized by the compiler
+ * and the check stops at the first chunk with data
+ */
+static inline bool Vdi::zero_data(char const * const data, uint64_t const size)
+{
+	enum { CHUNK = 512 };
+
+	uint64_t const * const words = (uint64_t const *)data;
+	uint64_t const count = size / sizeof(uint64_t);
+
+	for (uint64_t i = 0; i < count; i += CHUNK) {
+		uint64_t const end = Genode::min(i + CHUNK, count);
+
+		uint64_t bits = 0;
+		for (uint64_t w = i; w < end; w++)
+			bits |= words[w];
+
+		if (bits)
+			return false;
+	}
+
+	for (uint64_t i = count * sizeof(uint64_t); i < size; i++)
+		if (data[i]) return false;
+
+	return true;
+}
+
+
+struct Vdi::Meta_data
+{
+	uint32_t const blocks_offset;
+	uint32_t const data_offset;
+
+	uint32_t const block_size;
+	uint32_t const block_extra; /* bytes in front of each block */
+	uint32_t const sector_size;
+
+	Vdi::Table *table            { nullptr };
+	uint32_t    max_blocks       { 0 };
+	uint32_t    allocated_blocks { 0 };
+
+	/* physical blocks released by TRIM, reused by later allocations */
+	enum { MAX_RELEASED = 64 };
+
+	uint32_t    released[MAX_RELEASED] { };
+	unsigned    released_count         { 0 };
+
+	/*
+	 * Released blocks wait until their zero entry is durable, the first
+	 * 'pending_durable' ones may be reused
+	 */
+	uint32_t    pending[MAX_RELEASED]  { };
+	unsigned    pending_count          { 0 };
+	unsigned    pending_durable        { 0 };
+
+	int fd { -1 };
+
+	Meta_data(uint32_t blocks, uint32_t data, uint32_t block_size,
+	          uint32_t block_extra, uint32_t sector_size)
+	:
+		blocks_offset(blocks), data_offset(data),
+		block_size(block_size), block_extra(block_extra),
+		sector_size(sector_size)
+	{ }
+
+	uint32_t sectors_per_block() const { return block_size / sector_size; }
+
+	/* file offset of the data of physical block 'pid' */
+	uint64_t block_offset(uint64_t const pid, uint64_t const data) const
+	{
+		return data + pid * (uint64_t(block_size) + block_extra) + block_extra;
+	}
+
+	uint64_t block_offset(uint64_t const pid) const {
+		return block_offset(pid, data_offset); }
+
+	bool exhausted() const {
+		return !released_count && allocated_blocks >= max_blocks; }
+
+	/* physical block handed out by the next allocation */
+	uint32_t next_block() const
+	{
+		return released_count ? released[released_count - 1]
+		                      : allocated_blocks;
+	}
+
+	/* file offset of the block handed out by the next allocation */
+	uint64_t next_block_offset() const
+	{
+		return block_offset(next_block());
+	}
+
+	template <typename T, typename E>
+	bool alloc_block(uint64_t const bid, T const &fn, E const &err)
+	{
+		if (bid >= max_blocks) {
+			err();
+			return false;
+		}
+
+		uint32_t const pid = next_block();
+
+		if (!fn(next_block_offset()))
+			return false;
+
+		table->block(bid, Vdi::Block { pid });
+
+		if (released_count && released[released_count - 1] == pid)
+			released_count--;
+		else
+			allocated_blocks++;
+
+		return true;
+	}
+
+	/*
+	 * Mark block as zero, returns false if the physical block could not be
+	 * remembered for reuse and stays unused until compaction
+	 */
+	bool zero_block(uint64_t const bid)
+	{
+		if (bid >= max_blocks)
+			return true;
+
+		Vdi::Block const old = table->block(bid);
+
+		table->block(bid, Vdi::Block { Vdi::Block::BLOCK_ZERO });
+
+		if (!old.allocated())
+			return true;
+
+		if (pending_count >= MAX_RELEASED)
+			return false;
+
+		pending[pending_count++] = old.value;
+		return true;
+	}
+
+	/* the zero entries of the first 'count' pending blocks got synced */
+	void persisted(unsigned const count)
+	{
+		pending_durable = Genode::max(pending_durable,
+		                              Genode::min(count, pending_count));
+	}
+
+	/* make durable pending blocks reusable, unless still 'referenced' */
+	template <typename FN>
+	void reuse(FN const &referenced)
+	{
+		unsigned kept = 0, durable = 0;
+
+		for (unsigned i = 0; i < pending_count; i++) {
+			uint32_t const pid = pending[i];
+
+			if (i < pending_durable && released_count < MAX_RELEASED &&
+			    !referenced(pid)) {
+				released[released_count++] = pid;
+				continue;
+			}
+
+			if (i < pending_durable)
+				durable++;
+
+			pending[kept++] = pid;
+		}
+
+		pending_count   = kept;
+		pending_durable = durable;
+	}
+};
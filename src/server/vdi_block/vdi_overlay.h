@@ -0,0 +1,229 @@
+/*
+ * \brief  Volatile overlay of the virtual disk in RAM
+ * \author Alexander Boettcher
+ * \date   2026-10-16
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#pragma once
+
+/* Genode includes */
+#include <base/allocator.h>
+#include <base/attached_ram_dataspace.h>
+
+namespace Vdi { class Overlay; }
+
+
+/*
+ * Written sectors per VDI block, the memory of a block is allocated on its
+ * first write and kept for reuse if all its sectors got discarded
+ */
+class Vdi::Overlay
+{
+	public:
+
+		struct Block
+		{
+			uint64_t   bid;
+			uint32_t   next;    /* hash chain, slot + 1 or 0 */
+			bool       present;
+			unsigned   valid;   /* number of written sectors */
+			uint64_t * bits;    /* written sectors */
+
+			Genode::Attached_ram_dataspace *ds;
+		};
+
+	private:
+
+		Overlay(Overlay const &) = delete;
+		Overlay &operator = (Overlay const &) = delete;
+
+		Genode::Ram_allocator &_ram;
+		Genode::Region_map    &_rm;
+		Genode::Allocator     &_alloc;
+
+		Genode::size_t const _block_size;
+		Genode::size_t const _sector_size;
+		unsigned       const _sectors;
+		unsigned       const _words;
+		unsigned       const _count;
+		unsigned       const _buckets;
+
+		/* block descriptors, hash buckets and sector bits */
+		Genode::Attached_ram_dataspace _ds;
+
+		Block    * const _blocks;
+		uint32_t * const _bucket;
+
+		unsigned _used { 0 };
+
+		static unsigned _bucket_count(unsigned const count)
+		{
+			unsigned buckets = 1;
+			while (buckets < count) buckets <<= 1;
+			return buckets;
+		}
+
+		unsigned _slot(Block const &block) const { return unsigned(&block - _blocks); }
+
+		uint32_t &_head(uint64_t const bid) { return _bucket[bid & (_buckets - 1)]; }
+
+	public:
+
+		Overlay(Genode::Ram_allocator &ram, Genode::Region_map &rm,
+		        Genode::Allocator &alloc, Genode::size_t const limit,
+		        Genode::size_t const block_size, Genode::size_t const sector_size)
+		:
+			_ram(ram), _rm(rm), _alloc(alloc),
+			_block_size(block_size), _sector_size(sector_size),
+			_sectors(unsigned(block_size / sector_size)),
+			_words((_sectors + 63) / 64),
+			_count(unsigned(Genode::max(limit / block_size, Genode::size_t(1)))),
+			_buckets(_bucket_count(_count)),
+			_ds(ram, rm, _count * (sizeof(Block) + _words * sizeof(uint64_t)) +
+			             _buckets * sizeof(uint32_t)),
+			_blocks(_ds.local_addr<Block>()),
+			_bucket((uint32_t *)(_blocks + _count))
+		{
+			uint64_t * const bits = (uint64_t *)(_bucket + _buckets);
+
+			for (unsigned i = 0; i < _count; i++)
+				_blocks[i] = { 0, 0, false, 0, bits + i * _words, nullptr };
+
+			for (unsigned i = 0; i < _buckets; i++)
+				_bucket[i] = 0;
+		}
+
+		~Overlay()
+		{
+			for (unsigned i = 0; i < _count; i++)
+				if (_blocks[i].ds)
+					Genode::destroy(_alloc, _blocks[i].ds);
+		}
+
+		unsigned blocks() const { return _count; }
+		unsigned used()   const { return _used; }
+
+		Genode::size_t sector_size() const { return _sector_size; }
+
+		char *content(Block const &block) { return block.ds->local_addr<char>(); }
+
+		Block *lookup(uint64_t const bid)
+		{
+			for (uint32_t s = _head(bid); s; s = _blocks[s - 1].next)
+				if (_blocks[s - 1].bid == bid)
+					return &_blocks[s - 1];
+
+			return nullptr;
+		}
+
+		/*
+		 * Block for 'bid' without written sectors
+		 *
+		 * \return nullptr if the limit is reached or RAM is exhausted
+		 */
+		Block *alloc(uint64_t const bid)
+		{
+			Block *block = nullptr;
+
+			for (unsigned i = 0; i < _count && !block; i++)
+				if (!_blocks[i].present) block = &_blocks[i];
+
+			if (!block)
+				return nullptr;
+
+			if (!block->ds) {
+				try {
+					block->ds = new (_alloc)
+						Genode::Attached_ram_dataspace(_ram, _rm, _block_size);
+				} catch (...) {
+					return nullptr;
+				}
+			}
+
+			for (unsigned w = 0; w < _words; w++)
+				block->bits[w] = 0;
+
+			block->bid     = bid;
+			block->valid   = 0;
+			block->present = true;
+			block->next    = _head(bid);
+
+			_head(bid) = _slot(*block) + 1;
+			_used ++;
+
+			return block;
+		}
+
+		bool written(Block const &block, unsigned const sector) const {
+			return block.bits[sector / 64] & (1ull << (sector % 64)); }
+
+		bool written(Block const &block, unsigned const first, unsigned const num) const
+		{
+			for (unsigned s = first; s < first + num; s++)
+				if (!written(block, s)) return false;
+			return true;
+		}
+
+		void write(Block &block, unsigned const first, unsigned const num)
+		{
+			for (unsigned s = first; s < first + num; s++) {
+				if (written(block, s))
+					continue;
+
+				block.bits[s / 64] |= 1ull << (s % 64);
+				block.valid ++;
+			}
+		}
+
+		/* drop sectors, the block is freed if none is left */
+		void discard(Block &block, unsigned const first, unsigned const num)
+		{
+			for (unsigned s = first; s < first + num; s++) {
+				if (!written(block, s))
+					continue;
+
+				block.bits[s / 64] &= ~(1ull << (s % 64));
+				block.valid --;
+			}
+
+			if (block.valid)
+				return;
+
+			for (uint32_t *link = &_head(block.bid); *link; link = &_blocks[*link - 1].next) {
+				if (*link != _slot(block) + 1)
+					continue;
+
+				*link = block.next;
+				break;
+			}
+
+			block.present = false;
+			_used --;
+		}
+
+		/*
+		 * Split sector range into parts per VDI block, 'fn' gets the block
+		 * id, first sector and sector count within the block and the byte
+		 * offset relative to 'nr'
+		 */
+		template <typename FN>
+		void for_each_part(uint64_t const nr, uint64_t const count, FN const &fn) const
+		{
+			for (uint64_t s = nr; s < nr + count; ) {
+				unsigned const first = unsigned(s % _sectors);
+				unsigned const num   = unsigned(Genode::min(uint64_t(_sectors - first),
+				                                            nr + count - s));
+
+				fn(s / _sectors, first, num, (s - nr) * _sector_size);
+
+				s += num;
+			}
+		}
+};
@@ -0,0 +1,74 @@
+/*
+ * \brief  Lock-free ring between two threads
+ * \author Alexander Boettcher
+ * \date   2026-10-16
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#pragma once
+
+/* Genode includes */
+#include <cpu/memory_barrier.h>
+
+namespace Vdi { template <typename, unsigned> class Ring; }
+
+
+/*
+ * Ring with exactly one producer and one consumer thread, one slot stays
+ * unused to tell a full from an empty ring
+ */
+template <typename T, unsigned SIZE>
+class Vdi::Ring
+{
+	private:
+
+		T _items[SIZE] { };
+
+		unsigned volatile _head { 0 }; /* next item, written by consumer */
+		unsigned volatile _tail { 0 }; /* next free, written by producer */
+
+	public:
+
+		bool empty() const { return _head == _tail; }
+		bool full()  const { return (_tail + 1) % SIZE == _head; }
+
+		/**
+		 * Producer side, returns false if ring is full
+		 */
+		bool push(T const &item)
+		{
+			if (full())
+				return false;
+
+			_items[_tail] = item;
+
+			/* item must be visible before the consumer sees the new tail */
+			Genode::memory_barrier();
+
+			_tail = (_tail + 1) % SIZE;
+			return true;
+		}
+
+		/**
+		 * Consumer side, valid only if ring is not empty
+		 */
+		T const &front() const
+		{
+			Genode::memory_barrier();
+			return _items[_head];
+		}
+
+		void pop()
+		{
+			/* item must be consumed before the producer may reuse the slot */
+			Genode::memory_barrier();
+
+			_head = (_head + 1) % SIZE;
+		}
+};
@@ -0,0 +1,123 @@
+/*
+ * \brief  I/O statistics of the VDI driver
+ * \author Alexander Boettcher
+ * \date   2026-10-16
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#pragma once
+
+/* Genode includes */
+#include <os/reporter.h>
+
+namespace Vdi { struct Stats; }
+
+
+struct Vdi::Stats
+{
+	/*
+	 * Latencies in microseconds, bucket i counts latencies below 2^i us,
+	 * the last bucket takes all larger ones
+	 */
+	struct Histogram
+	{
+		enum { BUCKETS = 24 };
+
+		uint64_t count[BUCKETS] { };
+
+		void add(uint64_t const us)
+		{
+			unsigned i = 0;
+			while (i < BUCKETS - 1 && (us >> i)) i++;
+			count[i] ++;
+		}
+
+		void generate(Genode::Generator &g) const
+		{
+			for (unsigned i = 0; i < BUCKETS; i++) {
+				if (!count[i])
+					continue;
+
+				g.node("latency", [&] {
+					g.attribute("below_us", i < BUCKETS - 1 ? 1ull << i : 0ull);
+					g.attribute("count",    count[i]);
+				});
+			}
+		}
+	};
+
+	struct Ops
+	{
+		uint64_t  ops   { 0 };
+		uint64_t  bytes { 0 };
+		Histogram latency { };
+
+		void add(uint64_t const size, uint64_t const us)
+		{
+			ops   ++;
+			bytes += size;
+			latency.add(us);
+		}
+
+		void generate(Genode::Generator &g, char const * const name) const
+		{
+			g.node(name, [&] {
+				g.attribute("ops",   ops);
+				g.attribute("bytes", bytes);
+				latency.generate(g);
+			});
+		}
+	};
+
+	struct Timed
+	{
+		uint64_t count    { 0 };
+		uint64_t total_us { 0 };
+		uint64_t max_us   { 0 };
+
+		void add(uint64_t const us)
+		{
+			count    ++;
+			total_us += us;
+			max_us    = Genode::max(max_us, us);
+		}
+
+		void generate(Genode::Generator &g, char const * const name) const
+		{
+			g.node(name, [&] {
+				g.attribute("count",    count);
+				g.attribute("total_us", total_us);
+				g.attribute("max_us",   max_us);
+			});
+		}
+	};
+
+	Ops   read  { };
+	Ops   write { };
+	Ops   sync  { };
+	Ops   trim  { };
+	Timed alloc { };
+	Timed flush { };
+
+	uint64_t retries       { 0 };
+	uint64_t syncs_skipped { 0 }; /* nothing to flush */
+
+	void generate(Genode::Generator &g) const
+	{
+		g.attribute("retries",       retries);
+		g.attribute("syncs_skipped", syncs_skipped);
+
+		read .generate(g, "read");
+		write.generate(g, "write");
+		sync .generate(g, "sync");
+		trim .generate(g, "trim");
+		alloc.generate(g, "alloc");
+		flush.generate(g, "flush");
+	}
+};
@@ -0,0 +1,226 @@
+/*
+ * \brief  Block table of a VDI file
+ * \author Alexander Boettcher
+ * \date   2026-10-16
+ */
+
+/*
+ * Copyright (C) 2026 Genode Labs GmbH
+ *
+ * This file is part of the Genode OS framework, which is distributed
+ * under the terms of the GNU General Public License version 2.
+ */
+
+#pragma once
+
+/* Genode includes */
+#include <base/attached_ram_dataspace.h>
+
+/* local includes */
+#include <vdi_types.h>
+
+namespace Vdi {
+	struct Block;
+	struct Table;
+	class  Table_cache;
+} /* namespace Vdi */
+
+
+struct Vdi::Block
+{
+	uint32_t value;
+
+	enum {
+		BLOCK_FREE = ~0u,
+		BLOCK_ZERO = ~1u,
+	};
+
+	bool zero()      const { return value == BLOCK_ZERO; }
+	bool free()      const { return value == BLOCK_FREE; }
+	bool allocated() const { return value  < BLOCK_FREE; }
+};
+
+
+/*
+ * Access to the entries of the block table, the caller has to make sure
+ * the entry is present
+ */
+struct Vdi::Table : Genode::Interface
+{
+	virtual Vdi::Block block(uint64_t bid) = 0;
+
+	virtual void block(uint64_t bid, Vdi::Block) = 0;
+};
+
+
+/*
+ * Block table loaded page-wise on demand, the least recently used clean
+ * page is replaced when the page budget is used up
+ */
+class Vdi::Table_cache : public Vdi::Table
+{
+	public:
+
+		enum {
+			PAGE_SIZE = 4096,
+			ENTRIES   = PAGE_SIZE / sizeof(Vdi::Block),
+		};
+
+		struct Page
+		{
+			uint64_t index;   /* page of the block table */
+			uint64_t used;    /* LRU stamp */
+			bool     valid;
+			bool     dirty;
+			bool     loading;
+		};
+
+	private:
+
+		Table_cache(Table_cache const &) = delete;
+		Table_cache &operator = (Table_cache const &) = delete;
+
+		uint64_t const _blocks;
+		uint64_t const _table_pages;
+		unsigned const _count;
+
+		/* page content, page descriptors and page directory */
+		Genode::Attached_ram_dataspace _ds;
+
+		Vdi::Block * const _entries;
+		Page       * const _pages;
+		uint32_t   * const _directory; /* slot + 1 of a present page or 0 */
+
+		uint64_t _clock { 0 };
+
+		static Genode::size_t _ds_size(unsigned const count, uint64_t const table_pages)
+		{
+			return Genode::size_t(count * (PAGE_SIZE + sizeof(Page)) +
+			                      table_pages * sizeof(uint32_t));
+		}
+
+		/* at least two pages, so that a pinned page does not block loading */
+		static unsigned _page_count(Genode::size_t const budget, uint64_t const table_pages)
+		{
+			uint64_t const count = Genode::min(uint64_t(budget / PAGE_SIZE), table_pages);
+
+			return unsigned(Genode::max(count, Genode::min(table_pages, uint64_t(2))));
+		}
+
+		unsigned _slot(Page const &page) const { return unsigned(&page - _pages); }
+
+		Page &_page(uint64_t const bid) { return _pages[_directory[bid / ENTRIES] - 1]; }
+
+	public:
+
+		Table_cache(Genode::Ram_allocator &ram, Genode::Region_map &rm,
+		            uint64_t const blocks, Genode::size_t const budget)
+		:
+			_blocks(blocks),
+			_table_pages((blocks + ENTRIES - 1) / ENTRIES),
+			_count(_page_count(budget, _table_pages)),
+			_ds(ram, rm, _ds_size(_count, _table_pages)),
+			_entries(_ds.local_addr<Vdi::Block>()),
+			_pages((Page *)(_ds.local_addr<char>() + _count * PAGE_SIZE)),
+			_directory((uint32_t *)(_pages + _count))
+		{
+			for (unsigned i = 0; i < _count; i++)
+				_pages[i] = { 0, 0, false, false, false };
+
+			for (uint64_t i = 0; i < _table_pages; i++)
+				_directory[i] = 0;
+		}
+
+		unsigned pages() const { return _count; }
+
+		bool present(uint64_t const bid) const
+		{
+			return bid >= _blocks || _directory[bid / ENTRIES];
+		}
+
+		Vdi::Block block(uint64_t const bid) override
+		{
+			Page &page = _page(bid);
+			page.used = ++_clock;
+
+			return _entries[_slot(page) * ENTRIES + bid % ENTRIES];
+		}
+
+		void block(uint64_t const bid, Vdi::Block const value) override
+		{
+			Page &page = _page(bid);
+			page.used  = ++_clock;
+			page.dirty = true;
+
+			_entries[_slot(page) * ENTRIES + bid % ENTRIES] = value;
+		}
+
+		bool dirty() const
+		{
+			for (unsigned i = 0; i < _count; i++)
+				if (_pages[i].dirty) return true;
+			return false;
+		}
+
+		Page *first_dirty()
+		{
+			for (unsigned i = 0; i < _count; i++)
+				if (_pages[i].dirty) return &_pages[i];
+			return nullptr;
+		}
+
+		/*
+		 * Page to load 'bid' into, dirty and pinned pages are not replaced
+		 *
+		 * \return nullptr if no page is replaceable before a write back
+		 */
+		template <typename PINNED>
+		Page *replace(uint64_t const bid, PINNED const &pinned)
+		{
+			Page *victim = nullptr;
+
+			for (unsigned i = 0; i < _count; i++) {
+				Page &page = _pages[i];
+
+				if (page.loading || page.dirty || (page.valid && pinned(page)))
+					continue;
+
+				if (!victim || (victim->valid && (!page.valid || page.used < victim->used)))
+					victim = &page;
+			}
+
+			if (!victim)
+				return nullptr;
+
+			if (victim->valid)
+				_directory[victim->index] = 0;
+
+			*victim = { bid / ENTRIES, 0, false, false, true };
+
+			return victim;
+		}
+
+		void loaded(Page &page)
+		{
+			page.loading = false;
+			page.valid   = true;
+			page.used    = ++_clock;
+
+			_directory[page.index] = _slot(page) + 1;
+		}
+
+		char *content(Page const &page) {
+			return (char *)(_entries + _slot(page) * ENTRIES); }
+
+		/* byte offset of the page within the table and bytes used of it */
+		static uint64_t offset(Page const &page) { return page.index * PAGE_SIZE; }
+
+		Genode::size_t size(Page const &page) const
+		{
+			uint64_t const first = page.index * ENTRIES;
+			return Genode::size_t(Genode::min(_blocks - first, uint64_t(ENTRIES)) *
+			                      sizeof(Vdi::Block));
+		}
+
+		static uint64_t page_of(uint64_t const bid) { return bid / ENTRIES; }
+};
@@ -55,6 +55,9 @@ union Random_uuid
 	}
 
 	bool valid() const { return dce.time_low && dce.time_hi_and_version; }
+
+	bool operator == (Random_uuid const &o) const {
+		return au64[0] == o.au64[0] && au64[1] == o.au64[1]; }
 };
 
 